@@ -8,7 +8,7 @@ Scenario Outline: conversions to various outputs will produce exactly the same i
 
 Examples: images
 | image | file_type | converted_image | md5 |
-| x3f_test_files/_SDI8040.X3F | DNG | x3f_test_files/_SDI8040.X3F.dng | efa34925dd4e4425726da74cbae9955b |
+| x3f_test_files/_SDI8040.X3F | DNG | x3f_test_files/_SDI8040.X3F.dng | regenerate |
 | x3f_test_files/_SDI8040.X3F | TIFF | x3f_test_files/_SDI8040.X3F.tif | cb67d12ec0a4fd318a426276f527f1a9 |
 | x3f_test_files/_SDI8040.X3F | PPM | x3f_test_files/_SDI8040.X3F.ppm | a2bea89af18bb24efd289b73007b2413 |
 | x3f_test_files/_SDI8040.X3F | JPG | x3f_test_files/_SDI8040.X3F.jpg | 357f126f6435345642bfbc6171745d00 |
@@ -18,7 +18,7 @@ Examples: images
 | x3f_test_files/_SDI8040.X3F | HISTOGRAM | x3f_test_files/_SDI8040.X3F.csv | 8ad3868b2c7b871555932a783c16397d |
 | x3f_test_files/_SDI8040.X3F | LOGHIST | x3f_test_files/_SDI8040.X3F.csv | 0c23a7767659c894b81ba64326517eba |
 
-| x3f_test_files/_SDI8284.X3F | DNG | x3f_test_files/_SDI8284.X3F.dng | 71f56b6bdb9f3e403af2c21d16c76664 |
+| x3f_test_files/_SDI8284.X3F | DNG | x3f_test_files/_SDI8284.X3F.dng | regenerate |
 | x3f_test_files/_SDI8284.X3F | TIFF | x3f_test_files/_SDI8284.X3F.tif | 26199384d894ae723292e5ecc40ad194 |
 | x3f_test_files/_SDI8284.X3F | PPM | x3f_test_files/_SDI8284.X3F.ppm | 06c85f54fe3a954d4e564efbbb8d8a8b |
 | x3f_test_files/_SDI8284.X3F | JPG | x3f_test_files/_SDI8284.X3F.jpg | 87cd494d3bc4eab4e481de6afeb058de |
@@ -36,10 +36,10 @@ Scenario Outline: conversions to various compressed outputs will produce exactly
 
 Examples: images
 | image | file_type | converted_image | md5 |
-| x3f_test_files/_SDI8040.X3F | DNG | x3f_test_files/_SDI8040.X3F.dng | 00bcb49957164819385b52b48f027b89 |
+| x3f_test_files/_SDI8040.X3F | DNG | x3f_test_files/_SDI8040.X3F.dng | regenerate |
 | x3f_test_files/_SDI8040.X3F | TIFF | x3f_test_files/_SDI8040.X3F.tif | 94e05ac8c234d733fffd5e00ac068203 |
 
-| x3f_test_files/_SDI8284.X3F | DNG | x3f_test_files/_SDI8284.X3F.dng | 151316eb4ed6e1fe982a4a5feda218f0 |
+| x3f_test_files/_SDI8284.X3F | DNG | x3f_test_files/_SDI8284.X3F.dng | regenerate |
 | x3f_test_files/_SDI8284.X3F | TIFF | x3f_test_files/_SDI8284.X3F.tif | 2d71f992245597acc49f80d27f036d27 |
 
 
@@ -50,8 +50,8 @@ Scenario Outline: denoised conversions to dng will produce the exact same output
 
 Examples: images
 | image | converted_image | md5 |
-| x3f_test_files/_SDI8040.X3F | x3f_test_files/_SDI8040.X3F.dng | 8d62244e47bbd657587c376331b1a5da |
-| x3f_test_files/_SDI8284.X3F | x3f_test_files/_SDI8284.X3F.dng | f0bcd7161a5dd1a671e78d3978a24264 |
+| x3f_test_files/_SDI8040.X3F | x3f_test_files/_SDI8040.X3F.dng | regenerate |
+| x3f_test_files/_SDI8284.X3F | x3f_test_files/_SDI8284.X3F.dng | regenerate |
 
 
 Scenario Outline: denoised conversions to tiff will produce the exact same outputs
@@ -84,3 +84,47 @@ Examples: images
 | x3f_test_files/_SDI8284.X3F | COLOR_SRGB | x3f_test_files/_SDI8284.X3F.tif | 6ebfd835a023512151ba17c34d4dde59 |
 | x3f_test_files/_SDI8284.X3F | COLOR_ADOBE_RGB | x3f_test_files/_SDI8284.X3F.tif | d51a8a0e25ac60f1c55b469fd83f24b9 |
 | x3f_test_files/_SDI8284.X3F | COLOR_PROPHOTO_RGB | x3f_test_files/_SDI8284.X3F.tif | 558848876ef481e71801dd10d85b1a70 |
+
+
+Scenario Outline: a DNG streamed to stdout is identical to the DNG file
+   Given an input image <image> without a <converted_image>
+    when the <image> is converted by the code to DNG
+     and the <image> is streamed by the code as DNG to <streamed_image>
+    then the <streamed_image> has the same hash value as <converted_image>
+
+Examples: images
+| image | converted_image | streamed_image |
+| x3f_test_files/_SDI8040.X3F | x3f_test_files/_SDI8040.X3F.dng | x3f_test_files/_SDI8040.X3F.stdout.dng |
+| x3f_test_files/_SDI8284.X3F | x3f_test_files/_SDI8284.X3F.dng | x3f_test_files/_SDI8284.X3F.stdout.dng |
+
+
+Scenario Outline: conversions to DNG at reduced bit depth will produce exactly the same images
+   Given an input image <image> without a <converted_image>
+    when the <image> is converted to DNG with <dng_bits> bits <compression>
+    then the <converted_image> has the right <md5> hash value
+
+Examples: images
+| image | dng_bits | compression | converted_image | md5 |
+| x3f_test_files/_SDI8040.X3F | auto | uncompressed | x3f_test_files/_SDI8040.X3F.dng | regenerate |
+| x3f_test_files/_SDI8040.X3F | auto | compressed | x3f_test_files/_SDI8040.X3F.dng | regenerate |
+| x3f_test_files/_SDI8040.X3F | 12 | uncompressed | x3f_test_files/_SDI8040.X3F.dng | regenerate |
+| x3f_test_files/_SDI8040.X3F | 12 | compressed | x3f_test_files/_SDI8040.X3F.dng | regenerate |
+
+| x3f_test_files/_SDI8284.X3F | auto | uncompressed | x3f_test_files/_SDI8284.X3F.dng | regenerate |
+| x3f_test_files/_SDI8284.X3F | auto | compressed | x3f_test_files/_SDI8284.X3F.dng | regenerate |
+| x3f_test_files/_SDI8284.X3F | 12 | uncompressed | x3f_test_files/_SDI8284.X3F.dng | regenerate |
+| x3f_test_files/_SDI8284.X3F | 12 | compressed | x3f_test_files/_SDI8284.X3F.dng | regenerate |
+
+
+Scenario Outline: the number of threads does not change the output
+   Given an input image <image> without a <converted_image>
+    when the <image> is converted and compressed by the code to DNG
+     and the <image> is streamed by the code as a compressed DNG with <threads> threads to <streamed_image>
+    then the <streamed_image> has the same hash value as <converted_image>
+
+Examples: images
+| image | threads | converted_image | streamed_image |
+| x3f_test_files/_SDI8040.X3F | 1 | x3f_test_files/_SDI8040.X3F.dng | x3f_test_files/_SDI8040.X3F.stdout.dng |
+| x3f_test_files/_SDI8040.X3F | 3 | x3f_test_files/_SDI8040.X3F.dng | x3f_test_files/_SDI8040.X3F.stdout.dng |
+| x3f_test_files/_SDI8284.X3F | 1 | x3f_test_files/_SDI8284.X3F.dng | x3f_test_files/_SDI8284.X3F.stdout.dng |
+| x3f_test_files/_SDI8284.X3F | 3 | x3f_test_files/_SDI8284.X3F.dng | x3f_test_files/_SDI8284.X3F.stdout.dng |
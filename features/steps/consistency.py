@@ -20,6 +20,41 @@ def run_conversion(args):
     assert running_proc.returncode is 0
 
 
+def run_conversion_to_file(args, output):
+    print(args)
+    with open(output, 'wb') as out:  # stdout is the output, so it must not be a pipe that can fill up
+        running_proc = subprocess.Popen(args, stdout=out, stderr=subprocess.PIPE)
+        running_proc.communicate()
+    assert running_proc.returncode is 0
+
+
+def get_hash(converted_image):
+    with open(converted_image, 'rb') as ci:
+        return hashlib.md5(ci.read()).hexdigest()
+
+
+def remove_output(converted_image):
+    os.chmod(converted_image, 0666)
+    os.remove(converted_image)
+
+
+def update_hash(context, converted_image, md5, found_hash):
+    # With X3F_UPDATE_HASHES set, the expected hash in the Examples row that is being run
+    # is replaced by the one found, e.g. after a deliberate change of output.
+    row = getattr(context, 'active_outline', None)
+    assert row is not None and row.line is not None, "cannot locate the Examples row to update"
+    feature_file = context.feature.filename
+    with open(feature_file) as ff:
+        lines = ff.readlines()
+    line = lines[row.line - 1]
+    old_cell = ''.join(('| ', md5, ' |'))
+    assert line.count(''.join(('| ', converted_image, ' |'))) == 1 and line.count(old_cell) == 1, \
+        "line %d of %s is not the row for %s" % (row.line, feature_file, converted_image)
+    lines[row.line - 1] = line.replace(old_cell, ''.join(('| ', found_hash, ' |')))
+    with open(feature_file, 'w') as ff:
+        ff.writelines(lines)
+
+
 @given(u'an input image {image} without a {converted_image}')
 def step_impl(context, image, converted_image):
     assert os.path.isfile(image)
@@ -78,15 +113,53 @@ def step_impl(context, image, output_format):
     args = [found_executable] + args + [image]
     run_conversion(args)
 
+@when(u'the {image} is streamed by the code as DNG to {streamed_image}')
+def step_impl(context, image, streamed_image):
+    found_executable = get_dist_name()
+    args = [found_executable, "-dng", "-no-denoise", "-color", "none", "-no-crop", "-o", "-", image]
+    run_conversion_to_file(args, streamed_image)
+
+
+@when(u'the {image} is streamed by the code as a compressed DNG with {threads} threads to {streamed_image}')
+def step_impl(context, image, streamed_image, threads):
+    found_executable = get_dist_name()
+    args = [found_executable, "-dng", "-no-denoise", "-color", "none", "-compress", "-no-crop",
+            "-threads", threads, "-o", "-", image]
+    run_conversion_to_file(args, streamed_image)
+
+
+@when(u'the {image} is converted to DNG with {dng_bits} bits {compression}')
+def step_impl(context, image, dng_bits, compression):
+    found_executable = get_dist_name()
+    args = [found_executable, "-dng", "-no-denoise", "-color", "none", "-dng-bits", dng_bits]
+    if compression == 'compressed':
+        args = args + ["-compress"]
+    args = args + ["-no-crop", image]
+    run_conversion(args)
+
+
+@then(u'the {streamed_image} has the same hash value as {converted_image}')
+def step_impl(context, streamed_image, converted_image):
+    assert os.path.isfile(streamed_image)
+    assert os.path.isfile(converted_image)
+    streamed_hash = get_hash(streamed_image)
+    found_hash = get_hash(converted_image)
+    print("streamed_hash: ", streamed_hash, " file_hash: ", found_hash)
+    remove_output(streamed_image)
+    remove_output(converted_image)
+    assert streamed_hash == found_hash
+
+
 @then(u'the {converted_image} has the right {md5} hash value')
 def step_impl(context, converted_image, md5):
     assert os.path.isfile(converted_image)
-    with open(converted_image) as ci:
-        found_hash = hashlib.md5(ci.read()).hexdigest()
-        print("found_hash: ", found_hash, " expected_hash: ", md5)
+    found_hash = get_hash(converted_image)
+    print("found_hash: ", found_hash, " expected_hash: ", md5)
+    if md5 != found_hash and os.getenv('X3F_UPDATE_HASHES'):
+        update_hash(context, converted_image, md5, found_hash)
+    else:
         assert md5 == found_hash
-    os.chmod(converted_image, 0666)
-    os.remove(converted_image)  # normally, I'd remove this file in the environment
+    remove_output(converted_image)  # normally, I'd remove this file in the environment
     # however, if these files should always be removed, then remove them immediately after
     # the test should be sufficient.  This should be the last 'then' statement
     # if more tests are later made.
@@ -0,0 +1,269 @@
+/* X3F_ASYNC.C
+ *
+ * Library for running conversions asynchronously on the shared pool.
+ *
+ * Copyright 2016 - Roland and Erik Karlsson
+ * BSD-style - see doc/copyright.txt
+ *
+ */
+
+#include "x3f_async.h"
+#include "x3f_parallel.h"
+#include "x3f_output_dng.h"
+#include "x3f_output_tiff.h"
+#include "x3f_output_ppm.h"
+#include "x3f_histogram.h"
+#include "x3f_printf.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#include <unistd.h>
+#define HAVE_EVENTFD
+#endif
+
+struct x3f_render_s {
+  x3f_t *x3f;
+  x3f_render_options_t opt;
+  x3f_render_callback_t callback;
+  void *user;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int done;
+  x3f_return_t result;
+  int fd;			/* eventfd, or -1 */
+  int refs;			/* Held by the pool and by the caller */
+};
+
+static char *copy_string(const char *s)
+{
+  char *copy;
+
+  if (s == NULL) return NULL;
+  copy = malloc(strlen(s) + 1);
+  if (copy) strcpy(copy, s);
+
+  return copy;
+}
+
+static void release(x3f_render_t *r)
+{
+  int last;
+
+  pthread_mutex_lock(&r->lock);
+  last = --r->refs == 0;
+  pthread_mutex_unlock(&r->lock);
+
+  if (!last) return;
+
+#ifdef HAVE_EVENTFD
+  if (r->fd != -1) close(r->fd);
+#endif
+  free(r->opt.infilename);
+  free(r->opt.outfilename);
+  free(r->opt.wb);
+  pthread_cond_destroy(&r->cond);
+  pthread_mutex_destroy(&r->lock);
+  free(r);
+}
+
+static x3f_return_t load(x3f_t *x3f)
+{
+  x3f_directory_entry_t *DE = x3f_get_prop(x3f);
+  x3f_return_t ret;
+
+  if ((ret = x3f_load_data(x3f, x3f_get_camf(x3f))) != X3F_OK) return ret;
+  /* Not for Quattro */
+  if (DE != NULL && (ret = x3f_load_data(x3f, DE)) != X3F_OK) return ret;
+  return x3f_load_data(x3f, x3f_get_raw(x3f));
+}
+
+static x3f_return_t render(x3f_t *x3f, x3f_render_options_t *opt)
+{
+  int sgain = opt->apply_sgain == -1 ?
+    x3f->header.version < X3F_VERSION_4_0 : opt->apply_sgain;
+
+  switch (opt->format) {
+  case X3F_RENDER_DNG:
+    return x3f_dump_raw_data_as_dng(x3f, opt->outfilename,
+				    opt->denoise, sgain, opt->wb,
+				    opt->compress, opt->dng_bits,
+				    opt->rotation);
+  case X3F_RENDER_TIFF:
+    return x3f_dump_raw_data_as_tiff(x3f, opt->outfilename,
+				     opt->encoding,
+				     opt->crop, opt->denoise, sgain, opt->wb,
+				     opt->compress, opt->rotation);
+  case X3F_RENDER_PPMP3:
+  case X3F_RENDER_PPMP6:
+    return x3f_dump_raw_data_as_ppm(x3f, opt->outfilename,
+				    opt->encoding,
+				    opt->crop, opt->denoise, sgain, opt->wb,
+				    opt->format == X3F_RENDER_PPMP6,
+				    opt->rotation);
+  case X3F_RENDER_HISTOGRAM:
+    return x3f_dump_raw_data_as_histogram(x3f, opt->outfilename,
+					  opt->encoding,
+					  opt->crop, opt->denoise, sgain,
+					  opt->wb, opt->log_hist);
+  default:
+    x3f_printf(ERR, "Unknown render format %d\n", opt->format);
+    return X3F_ARGUMENT_ERROR;
+  }
+}
+
+static void run_render(void *arg)
+{
+  x3f_render_t *r = (x3f_render_t *)arg;
+  x3f_t *x3f = r->x3f;
+  FILE *f_in = NULL;
+  x3f_return_t ret;
+
+  if (x3f == NULL) {
+    if (r->opt.infilename == NULL ||
+	(f_in = fopen(r->opt.infilename, "rb")) == NULL ||
+	(x3f = x3f_new_from_file(f_in)) == NULL) {
+      x3f_printf(ERR, "Could not read infile %s\n",
+		 r->opt.infilename ? r->opt.infilename : "(none)");
+      ret = X3F_INFILE_ERROR;
+      goto done;
+    }
+    if ((ret = load(x3f)) != X3F_OK) {
+      x3f_printf(ERR, "Could not load infile %s\n", r->opt.infilename);
+      goto done;
+    }
+  }
+
+  ret = render(x3f, &r->opt);
+
+ done:
+  x3f_delete(x3f);
+  if (f_in != NULL) fclose(f_in);
+
+  pthread_mutex_lock(&r->lock);
+  r->result = ret;
+  r->done = 1;
+#ifdef HAVE_EVENTFD
+  if (r->fd != -1) {
+    uint64_t one = 1;
+
+    if (write(r->fd, &one, sizeof(one)) != sizeof(one))
+      x3f_printf(WARN, "Could not signal render completion\n");
+  }
+#endif
+  pthread_cond_broadcast(&r->cond);
+  pthread_mutex_unlock(&r->lock);
+
+  if (r->callback) r->callback(r, ret, r->user);
+
+  release(r);
+}
+
+/* extern */ void x3f_render_options_init(x3f_render_options_t *opt)
+{
+  memset(opt, 0, sizeof(x3f_render_options_t));
+  opt->format = X3F_RENDER_DNG;
+  opt->encoding = SRGB;
+  opt->crop = 1;
+  opt->denoise = 1;
+  opt->apply_sgain = -1;
+  opt->dng_bits = 16;
+}
+
+/* extern */ x3f_render_t *x3f_submit_render(x3f_t *x3f,
+					     const x3f_render_options_t *opt,
+					     x3f_render_callback_t callback,
+					     void *user)
+{
+  x3f_render_t *r = (x3f_render_t *)calloc(1, sizeof(x3f_render_t));
+
+  if (r == NULL) return NULL;
+
+  r->x3f = x3f_ref(x3f);
+  r->opt = *opt;
+  r->opt.infilename = copy_string(opt->infilename);
+  r->opt.outfilename = copy_string(opt->outfilename);
+  r->opt.wb = copy_string(opt->wb);
+  r->callback = callback;
+  r->user = user;
+  pthread_mutex_init(&r->lock, NULL);
+  pthread_cond_init(&r->cond, NULL);
+  r->fd = -1;
+  r->refs = 2;
+
+  if (opt->outfilename == NULL) {
+    x3f_printf(ERR, "No outfile given for render\n");
+    goto failed;
+  }
+
+  if (r->opt.outfilename == NULL ||
+      (opt->infilename != NULL && r->opt.infilename == NULL) ||
+      (opt->wb != NULL && r->opt.wb == NULL)) {
+    x3f_printf(ERR, "Could not allocate memory for render\n");
+    goto failed;
+  }
+
+  if (!x3f_pool_submit(run_render, r)) {
+    x3f_printf(ERR, "Could not submit render\n");
+    goto failed;
+  }
+
+  return r;
+
+ failed:
+  x3f_delete(x3f);
+  r->refs = 1;
+  release(r);
+  return NULL;
+}
+
+/* extern */ int x3f_render_poll(x3f_render_t *r)
+{
+  int done;
+
+  pthread_mutex_lock(&r->lock);
+  done = r->done;
+  pthread_mutex_unlock(&r->lock);
+
+  return done;
+}
+
+/* extern */ x3f_return_t x3f_render_wait(x3f_render_t *r)
+{
+  x3f_return_t ret;
+
+  pthread_mutex_lock(&r->lock);
+  while (!r->done)
+    pthread_cond_wait(&r->cond, &r->lock);
+  ret = r->result;
+  pthread_mutex_unlock(&r->lock);
+
+  return ret;
+}
+
+/* extern */ int x3f_render_fd(x3f_render_t *r)
+{
+  int fd = -1;
+
+#ifdef HAVE_EVENTFD
+  pthread_mutex_lock(&r->lock);
+  /* Created on demand. If the render is already done, the descriptor
+     is readable at once. */
+  if (r->fd == -1)
+    r->fd = eventfd(r->done ? 1 : 0, EFD_CLOEXEC);
+  fd = r->fd;
+  pthread_mutex_unlock(&r->lock);
+#endif
+
+  return fd;
+}
+
+/* extern */ void x3f_render_free(x3f_render_t *r)
+{
+  if (r != NULL) release(r);
+}
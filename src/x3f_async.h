@@ -0,0 +1,84 @@
+/* X3F_ASYNC.H
+ *
+ * Library for running conversions asynchronously on the shared pool.
+ *
+ * Copyright 2016 - Roland and Erik Karlsson
+ * BSD-style - see doc/copyright.txt
+ *
+ */
+
+#ifndef X3F_ASYNC_H
+#define X3F_ASYNC_H
+
+#include "x3f_io.h"
+#include "x3f_process.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum x3f_render_format_e {
+  X3F_RENDER_DNG=0,
+  X3F_RENDER_TIFF=1,
+  X3F_RENDER_PPMP3=2,
+  X3F_RENDER_PPMP6=3,
+  X3F_RENDER_HISTOGRAM=4,
+} x3f_render_format_t;
+
+typedef struct {
+  x3f_render_format_t format;
+  char *infilename;		/* Only used if no x3f is given */
+  char *outfilename;
+  x3f_color_encoding_t encoding; /* Not for DNG */
+  int crop;			/* Not for DNG */
+  int denoise;
+  int apply_sgain;		/* -1 means the default for the camera */
+  char *wb;			/* NULL means the camera's setting */
+  int compress;			/* DNG and TIFF */
+  int dng_bits;			/* See x3f_dump_raw_data_as_dng */
+  int rotation;			/* Degrees clockwise */
+  int log_hist;			/* Histogram */
+} x3f_render_options_t;
+
+/* Sets the same defaults as x3f_extract. Note that zero is not the
+   default for all options, e.g. dng_bits and apply_sgain. */
+extern void x3f_render_options_init(x3f_render_options_t *opt);
+
+typedef struct x3f_render_s x3f_render_t;
+
+/* Called on a pool thread when the render is done. It must not call
+   x3f_render_wait or x3f_render_free for the same render. */
+typedef void (*x3f_render_callback_t)(x3f_render_t *render,
+				      x3f_return_t result,
+				      void *user);
+
+/* Queue a render and return at once. x3f must already be loaded; a
+   reference to it is held until the render is done. With x3f NULL,
+   opt->infilename is read and loaded as part of the render. The
+   options, including strings, are copied. callback may be NULL.
+   Returns NULL if the render could not be queued. */
+extern x3f_render_t *x3f_submit_render(x3f_t *x3f,
+				       const x3f_render_options_t *opt,
+				       x3f_render_callback_t callback,
+				       void *user);
+
+/* Returns 1 when the render is done, without blocking */
+extern int x3f_render_poll(x3f_render_t *render);
+
+/* Blocks until the render is done and returns its result */
+extern x3f_return_t x3f_render_wait(x3f_render_t *render);
+
+/* Returns a file descriptor that becomes readable when the render is
+   done, for use with poll, epoll or select. The descriptor belongs to
+   the render. Returns -1 where eventfd is not available. */
+extern int x3f_render_fd(x3f_render_t *render);
+
+/* Releases the handle. A render that is still running completes in
+   the background, but its result can no longer be retrieved. */
+extern void x3f_render_free(x3f_render_t *render);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
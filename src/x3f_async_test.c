@@ -0,0 +1,271 @@
+/* X3F_ASYNC_TEST.C
+ *
+ * Test of library for running conversions asynchronously.
+ *
+ * Copyright 2016 - Roland and Erik Karlsson
+ * BSD-style - see doc/copyright.txt
+ *
+ */
+
+#include "x3f_version.h"
+#include "x3f_io.h"
+#include "x3f_async.h"
+#include "x3f_printf.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__linux__)
+#include <poll.h>
+#define HAVE_POLL
+#endif
+
+#define MAXPATH 1024
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int callbacks = 0;
+static int callback_errors = 0;
+
+static void usage(char *progname)
+{
+  fprintf(stderr,
+          "usage: %s [-n <N>] [-o <dir>] [<X3F-file> ...]\n"
+	  "   -n <N>    Number of renders per test (def=16)\n"
+	  "   -o <dir>  Directory for the output files (def=.)\n"
+	  "Without files, only renders of a missing file are tested\n",
+          progname);
+  exit(1);
+}
+
+static void callback(x3f_render_t *render, x3f_return_t result, void *user)
+{
+  x3f_return_t *expected = (x3f_return_t *)user;
+
+  pthread_mutex_lock(&lock);
+  if (result != *expected) callback_errors++;
+  callbacks++;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&lock);
+}
+
+/* The result is available before the callback has returned, so the
+   callbacks are counted separately */
+static void wait_for_callbacks(int num)
+{
+  pthread_mutex_lock(&lock);
+  while (callbacks < num)
+    pthread_cond_wait(&cond, &lock);
+  pthread_mutex_unlock(&lock);
+}
+
+/* Every other render is waited for with poll, where available, and the
+   others by polling the handle before blocking */
+static x3f_return_t wait_for_render(x3f_render_t *render, int index)
+{
+#ifdef HAVE_POLL
+  if (index % 2 == 0) {
+    struct pollfd p;
+
+    p.fd = x3f_render_fd(render);
+    p.events = POLLIN;
+    if (p.fd == -1 || poll(&p, 1, -1) != 1) {
+      fprintf(stderr, "Could not poll render %d\n", index);
+      return X3F_INTERNAL_ERROR;
+    }
+    if (!x3f_render_poll(render)) {
+      fprintf(stderr, "Render %d signalled before it was done\n", index);
+      return X3F_INTERNAL_ERROR;
+    }
+  }
+#endif
+
+  if (index % 3 == 0)
+    while (!x3f_render_poll(render))
+      ;
+
+  return x3f_render_wait(render);
+}
+
+static int run_renders(x3f_render_t **renders, int num,
+		       x3f_return_t expected)
+{
+  int errors = 0, j;
+
+  for (j=0; j < num; j++) {
+    if (renders[j] == NULL) {
+      errors++;
+      continue;
+    }
+    if (wait_for_render(renders[j], j) != expected) {
+      fprintf(stderr, "Render %d: unexpected result\n", j);
+      errors++;
+    }
+    x3f_render_free(renders[j]);
+  }
+
+  return errors;
+}
+
+static int same_contents(char *name1, char *name2)
+{
+  FILE *f1 = fopen(name1, "rb");
+  FILE *f2 = fopen(name2, "rb");
+  int same = f1 != NULL && f2 != NULL;
+
+  while (same) {
+    int c1 = getc(f1), c2 = getc(f2);
+
+    if (c1 != c2) same = 0;
+    else if (c1 == EOF) break;
+  }
+
+  if (f1 != NULL) fclose(f1);
+  if (f2 != NULL) fclose(f2);
+
+  return same;
+}
+
+/* Renders of a file that does not exist run the whole handle life
+   cycle without any image data */
+static int test_missing_file(int num)
+{
+  static x3f_return_t expected = X3F_INFILE_ERROR;
+  x3f_render_options_t opt;
+  x3f_render_t **renders = calloc(num, sizeof(x3f_render_t *));
+  int errors = 0, j;
+
+  printf("RENDER A MISSING FILE %d TIMES, ERRORS ARE EXPECTED\n", num);
+
+  x3f_render_options_init(&opt);
+  opt.infilename = "x3f_async_test-missing.x3f";
+  opt.outfilename = "x3f_async_test-missing.dng";
+
+  callbacks = 0;
+  for (j=0; j < num; j++)
+    renders[j] = x3f_submit_render(NULL, &opt, callback, &expected);
+  errors += run_renders(renders, num, expected);
+  wait_for_callbacks(num);
+
+  opt.outfilename = NULL;
+  if (x3f_submit_render(NULL, &opt, NULL, NULL) != NULL) {
+    fprintf(stderr, "Render without outfile was accepted\n");
+    errors++;
+  }
+
+  free(renders);
+
+  return errors;
+}
+
+/* All renders of the same file, loaded once or by the render itself,
+   must give identical output */
+static int test_file(char *infilename, char *outdir, int num)
+{
+  static x3f_return_t expected = X3F_OK;
+  FILE *f_in = fopen(infilename, "rb");
+  x3f_t *x3f;
+  x3f_directory_entry_t *DE;
+  x3f_render_options_t opt;
+  x3f_render_t **renders;
+  char (*outfiles)[MAXPATH];
+  int errors = 0, j;
+
+  if (f_in == NULL) {
+    fprintf(stderr, "Could not open infile %s\n", infilename);
+    return 1;
+  }
+
+  printf("READ THE X3F FILE %s\n", infilename);
+  x3f = x3f_new_from_file(f_in);
+  DE = x3f != NULL ? x3f_get_prop(x3f) : NULL;
+  if (x3f == NULL ||
+      x3f_load_data(x3f, x3f_get_camf(x3f)) != X3F_OK ||
+      (DE != NULL && x3f_load_data(x3f, DE) != X3F_OK) ||
+      x3f_load_data(x3f, x3f_get_raw(x3f)) != X3F_OK) {
+    fprintf(stderr, "Could not load infile %s\n", infilename);
+    x3f_delete(x3f);
+    fclose(f_in);
+    return 1;
+  }
+
+  renders = calloc(num + 1, sizeof(x3f_render_t *));
+  outfiles = calloc(num + 1, MAXPATH);
+
+  x3f_render_options_init(&opt);
+  opt.denoise = 0;		/* Keeps the test fast */
+
+  printf("RENDER IT %d TIMES FROM ONE LOADED COPY AND ONCE FROM FILE\n", num);
+
+  callbacks = 0;
+  for (j=0; j <= num; j++) {
+    snprintf(outfiles[j], MAXPATH, "%s/x3f_async_test-%d.dng", outdir, j);
+    opt.outfilename = outfiles[j];
+    /* The last one reads the file itself */
+    opt.infilename = j == num ? infilename : NULL;
+    renders[j] = x3f_submit_render(j == num ? NULL : x3f, &opt,
+				   callback, &expected);
+  }
+
+  /* The renders hold their own references */
+  x3f_delete(x3f);
+
+  errors += run_renders(renders, num + 1, expected);
+  wait_for_callbacks(num + 1);
+
+  printf("COMPARE THE OUTPUT\n");
+  for (j=1; j <= num; j++)
+    if (!same_contents(outfiles[0], outfiles[j])) {
+      fprintf(stderr, "%s differs from %s\n", outfiles[j], outfiles[0]);
+      errors++;
+    }
+
+  for (j=0; j <= num; j++)
+    remove(outfiles[j]);
+
+  free(outfiles);
+  free(renders);
+  fclose(f_in);
+
+  return errors;
+}
+
+int main(int argc, char *argv[])
+{
+  char *outdir = ".";
+  int num = 16;
+  int errors = 0;
+  int i;
+
+  printf("X3F TOOLS VERSION = %s\n\n", version);
+
+  for (i=1; i<argc; i++)
+    if (!strcmp(argv[i], "-n") && (i+1)<argc)
+      num = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-o") && (i+1)<argc)
+      outdir = argv[++i];
+    else if (!strncmp(argv[i], "-", 1))
+      usage(argv[0]);
+    else
+      break;			/* Here starts list of files */
+
+  if (num < 1) usage(argv[0]);
+
+  x3f_printf_level = ERR;
+  errors += test_missing_file(num);
+  x3f_printf_level = WARN;
+
+  for (; i<argc; i++)
+    errors += test_file(argv[i], outdir, num);
+
+  if (callback_errors > 0) {
+    fprintf(stderr, "%d callbacks got unexpected results\n", callback_errors);
+    errors += callback_errors;
+  }
+
+  printf("%s: %d errors\n", errors ? "FAILED" : "PASSED", errors);
+
+  return errors > 0;
+}
@@ -11,6 +11,7 @@
 #include "x3f_version.h"
 #include "x3f_io.h"
 #include "x3f_process.h"
+#include "x3f_meta.h"
 #include "x3f_output_dng.h"
 #include "x3f_output_tiff.h"
 #include "x3f_output_ppm.h"
@@ -18,6 +19,7 @@
 #include "x3f_print_meta.h"
 #include "x3f_dump.h"
 #include "x3f_denoise.h"
+#include "x3f_parallel.h"
 #include "x3f_printf.h"
 
 #include <stdio.h>
@@ -50,6 +52,8 @@ static void usage(char *progname)
   fprintf(stderr,
           "usage: %s <SWITCHES> <file1> ...\n"
           "   -o <DIR>        Use <DIR> as output directory\n"
+          "   -o -            Stream DNG output to stdout, without seeking\n"
+          "                   NOTE: Only one infile and only DNG output\n"
           "   -v              Verbose output for debugging\n"
           "   -q              Suppress all messages except errors\n"
 	  "ONE OFF THE FORMAT SWITCHWES\n"
@@ -77,6 +81,17 @@ static void usage(char *progname)
           "   -sgain          Apply spatial gain (default except for Quattro)\n"
           "   -wb <WB>        Select white balance preset\n"
           "   -compress       Enable ZIP compression for DNG and TIFF output\n"
+          "   -dng-bits <N>   Bits per sample in DNG output, 8 ... 16 (def=16)\n"
+          "                   'auto' means as few as possible without loss\n"
+          "                   Fewer bits are stored with a linearization table\n"
+          "   -rotate         Rotate TIFF and PPM output to the camera orientation\n"
+          "                   DNG output is tagged with the orientation instead\n"
+          "                   Not available for Quattro\n"
+          "   -group          Process files grouped by camera, firmware and\n"
+          "                   aperture, larger files first, instead of in\n"
+          "                   command line order. Quattro files are not\n"
+          "                   grouped; they are processed last, in order\n"
+          "   -threads <N>    Number of threads (def=0, i.e. one per CPU)\n"
           "   -ocl            Use OpenCL\n"
 	  "\n"
 	  "STRANGE STUFF\n"
@@ -92,6 +107,11 @@ static void usage(char *progname)
 #include <unistd.h>
 #include <errno.h>
 
+#if defined(_WIN32) || defined(_WIN64)
+#include <io.h>
+#include <fcntl.h>
+#endif
+
 static int check_dir(char *Path)
 {
   struct stat filestat;
@@ -169,6 +189,80 @@ static int make_paths(const char *inpath, const char *outdir,
   return err;
 }
 
+/* Files that share camera body, firmware and lens aperture also share
+   the CAMF calibration data (bad pixels, matrices, spatial gain), so
+   with -group they are processed next to each other. Nothing is cached
+   between files yet, so for now this only keeps the files of a camera
+   together. An empty key means that the body is not known. */
+
+#define KEYSIZE 256
+
+typedef struct {
+  char *infile;
+  char key[KEYSIZE];
+  off_t size;
+  int index;			/* Position on the command line */
+} batch_job_t;
+
+static const char *key_props[] = {"CAMMODEL", "CAMSERIAL", "FIRMVERS",
+				  "AP_DESC"};
+
+/* Only reads the header, the directory and the PROP section, which is
+   cheap compared to the image data */
+static void get_calibration_key(batch_job_t *job)
+{
+  FILE *f_in = fopen(job->infile, "rb");
+  struct stat filestat;
+  x3f_t *x3f;
+
+  job->key[0] = '\0';
+  job->size = stat(job->infile, &filestat) == 0 ? filestat.st_size : 0;
+
+  if (f_in == NULL) return;
+
+  if ((x3f = x3f_new_from_file(f_in)) != NULL) {
+    x3f_directory_entry_t *DE = x3f_get_prop(x3f);
+    int k;
+
+    /* TODO: Quattro has no PROP section, and nothing else that is
+       read here identifies the body, so its key is left empty */
+    if (DE != NULL && X3F_OK == x3f_load_data(x3f, DE))
+      for (k=0; k < sizeof(key_props)/sizeof(key_props[0]); k++) {
+	char *value;
+
+	/* The tab sorts before any printable character, so sorting on
+	   the key groups on the properties in order */
+	if (!x3f_get_prop_entry(x3f, (char *)key_props[k], &value))
+	  value = "";
+	if (k > 0) safecat(job->key, "\t", KEYSIZE - 1);
+	safecat(job->key, value, KEYSIZE - 1);
+      }
+
+    x3f_delete(x3f);
+  }
+
+  fclose(f_in);
+}
+
+/* Same key first, larger files first within a key, otherwise keep the
+   command line order. Files with unknown keys come last, in command
+   line order. */
+static int compare_jobs(const void *a, const void *b)
+{
+  const batch_job_t *ja = (const batch_job_t *)a;
+  const batch_job_t *jb = (const batch_job_t *)b;
+  int cmp;
+
+  if (ja->key[0] == '\0' || jb->key[0] == '\0') {
+    if (ja->key[0] != jb->key[0]) return ja->key[0] == '\0' ? 1 : -1;
+    return ja->index - jb->index;
+  }
+
+  if ((cmp = strcmp(ja->key, jb->key)) != 0) return cmp;
+  if (ja->size != jb->size) return ja->size > jb->size ? -1 : 1;
+  return ja->index - jb->index;
+}
+
 #define Z extract_jpg=0,extract_raw=0,extract_unconverted_raw=0
 
 int main(int argc, char *argv[])
@@ -187,17 +281,17 @@ int main(int argc, char *argv[])
   int log_hist = 0;
   char *wb = NULL;
   int compress = 0;
+  int dng_bits = 16;
+  int rotate = 0;
   int use_opencl = 0;
   char *outdir = NULL;
+  int to_stdout = 0;
+  int group = 0;
+  batch_job_t *jobs;
+  int num_jobs, j;
 
   int i;
 
-  x3f_printf(INFO, "X3F TOOLS VERSION = %s\n\n", version);
-
-  /* Set stdout and stderr to line buffered mode to avoid scrambling */
-  setvbuf(stdout, NULL, _IOLBF, 0);
-  setvbuf(stderr, NULL, _IOLBF, 0);
-
   for (i=1; i<argc; i++)
 
     /* Only one of those switches is valid, the last one */
@@ -257,6 +351,26 @@ int main(int argc, char *argv[])
       wb = argv[++i];
     else if (!strcmp(argv[i], "-compress"))
       compress = 1;
+    else if ((!strcmp(argv[i], "-dng-bits")) && (i+1)<argc) {
+      char *bits = argv[++i];
+      char *end;
+      long val = strtol(bits, &end, 10);
+
+      if (!strcmp(bits, "auto"))
+	dng_bits = 0;
+      else if (end != bits && *end == '\0' && val >= 8 && val <= 16)
+	dng_bits = val;
+      else {
+	fprintf(stderr, "Unsupported DNG bit depth: %s\n", bits);
+	usage(argv[0]);
+      }
+    }
+    else if (!strcmp(argv[i], "-group"))
+      group = 1;
+    else if (!strcmp(argv[i], "-rotate"))
+      rotate = 1;
+    else if ((!strcmp(argv[i], "-threads")) && (i+1)<argc)
+      x3f_set_num_threads(atoi(argv[++i]));
     else if (!strcmp(argv[i], "-ocl"))
       use_opencl = 1;
 
@@ -270,7 +384,29 @@ int main(int argc, char *argv[])
     else
       break;			/* Here starts list of files */
 
-  if (outdir != NULL && check_dir(outdir) != 0) {
+  to_stdout = outdir != NULL && !strcmp(outdir, "-");
+
+  if (to_stdout) {
+    /* stdout carries the image data, so only errors and warnings are
+       printed (to stderr) */
+    if (x3f_printf_level > WARN) x3f_printf_level = WARN;
+#if defined(_WIN32) || defined(_WIN64)
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+  }
+  else
+    /* Set stdout to line buffered mode to avoid scrambling */
+    setvbuf(stdout, NULL, _IOLBF, 0);
+  setvbuf(stderr, NULL, _IOLBF, 0);
+
+  x3f_printf(INFO, "X3F TOOLS VERSION = %s\n\n", version);
+
+  if (to_stdout && (file_type != DNG || argc - i > 1)) {
+    x3f_printf(ERR, "Only a single DNG file can be streamed to stdout\n");
+    usage(argv[0]);
+  }
+
+  if (outdir != NULL && !to_stdout && check_dir(outdir) != 0) {
     x3f_printf(ERR, "Could not find outdir %s\n", outdir);
     usage(argv[0]);
   }
@@ -283,8 +419,21 @@ int main(int argc, char *argv[])
     (extract_raw &&
      (crop || (color_encoding != UNPROCESSED && color_encoding != QTOP)));
 
-  for (; i<argc; i++) {
-    char *infile = argv[i];
+  num_jobs = argc - i;
+  jobs = (batch_job_t *)calloc(num_jobs > 0 ? num_jobs : 1, sizeof(batch_job_t));
+  for (j=0; j < num_jobs; j++) {
+    jobs[j].infile = argv[i + j];
+    jobs[j].index = j;
+  }
+
+  if (group && num_jobs > 1) {
+    for (j=0; j < num_jobs; j++)
+      get_calibration_key(&jobs[j]);
+    qsort(jobs, num_jobs, sizeof(batch_job_t), compare_jobs);
+  }
+
+  for (j=0; j < num_jobs; j++) {
+    char *infile = jobs[j].infile;
     FILE *f_in = fopen(infile, "rb");
     x3f_t *x3f = NULL;
 
@@ -292,6 +441,7 @@ int main(int argc, char *argv[])
     char outfile[MAXOUTPATH+1];
     x3f_return_t ret_dump;
     int sgain;
+    int rotation;
 
     files++;
 
@@ -345,7 +495,8 @@ int main(int argc, char *argv[])
       }
     }
 
-    if (make_paths(infile, outdir, extension[file_type], tmpfile, outfile)) {
+    if (!to_stdout &&
+	make_paths(infile, outdir, extension[file_type], tmpfile, outfile)) {
       x3f_printf(ERR, "Too large outfile path for infile %s and outdir %s\n",
 		 infile, outdir);
       goto found_error;
@@ -357,6 +508,29 @@ int main(int argc, char *argv[])
     sgain =
       apply_sgain == -1 ? x3f->header.version < X3F_VERSION_4_0 : apply_sgain;
 
+    /* TODO: the rotation for version >= 4.0 (Quattro) is not known */
+    if (rotate && x3f->header.version >= X3F_VERSION_4_0)
+      x3f_printf(WARN, "-rotate ignored, %s has no rotation in its header\n",
+		 infile);
+
+    rotation = rotate ? x3f->header.rotation : 0;
+    if (rotation < 0 || rotation % 90 != 0 || rotation >= 360) {
+      x3f_printf(WARN, "Ignoring unknown rotation %d\n", rotation);
+      rotation = 0;
+    }
+
+    if (to_stdout) {
+      x3f_printf(INFO, "Stream RAW as DNG to stdout\n");
+      ret_dump = x3f_dump_raw_data_as_dng_stream(x3f, stdout,
+						 denoise, sgain, wb,
+						 compress, dng_bits, rotation);
+      if (X3F_OK != ret_dump) {
+	x3f_printf(ERR, "Could not stream to stdout: %s\n", x3f_err(ret_dump));
+	errors++;
+      }
+      goto clean_up;
+    }
+
     switch (file_type) {
     case META:
       x3f_printf(INFO, "Dump META DATA to %s\n", outfile);
@@ -375,13 +549,13 @@ int main(int argc, char *argv[])
       ret_dump = x3f_dump_raw_data_as_tiff(x3f, tmpfile,
 					   color_encoding,
 					   crop, denoise, sgain, wb,
-					   compress);
+					   compress, rotation);
       break;
     case DNG:
       x3f_printf(INFO, "Dump RAW as DNG to %s\n", outfile);
       ret_dump = x3f_dump_raw_data_as_dng(x3f, tmpfile,
 					  denoise, sgain, wb,
-					  compress);
+					  compress, dng_bits, rotation);
       break;
     case PPMP3:
     case PPMP6:
@@ -389,7 +563,7 @@ int main(int argc, char *argv[])
       ret_dump = x3f_dump_raw_data_as_ppm(x3f, tmpfile,
 					  color_encoding,
 					  crop, denoise, sgain, wb,
-					  file_type == PPMP6);
+					  file_type == PPMP6, rotation);
       break;
     case HISTOGRAM:
       x3f_printf(INFO, "Dump RAW as CSV histogram to %s\n", outfile);
@@ -431,5 +605,7 @@ int main(int argc, char *argv[])
 
   x3f_printf(INFO, "Files processed: %d\terrors: %d\n", files, errors);
 
+  free(jobs);
+
   return errors > 0;
 }
@@ -13,6 +13,8 @@
 #include "x3f_printf.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 /* extern */ int x3f_image_area(x3f_t *x3f, x3f_area16_t *image)
@@ -40,7 +42,8 @@
   if (!area || !area->data) return 0;
   *image = *area;
   image->buf = NULL;		/* cleanup_true/cleanup_huffman is
-				   responsible for free() */
+				   responsible for free(). The data is
+				   shared and must not be modified. */
   return 1;
 }
 
@@ -64,6 +67,25 @@
   return 1;
 }
 
+/* extern */ int x3f_copy_area(x3f_area16_t *image, x3f_area16_t *copy)
+{
+  uint32_t row_size = image->columns*image->channels;
+  int row;
+
+  copy->columns = image->columns;
+  copy->rows = image->rows;
+  copy->channels = image->channels;
+  copy->row_stride = row_size;
+  copy->data = copy->buf = malloc(image->rows*row_size*sizeof(uint16_t));
+  if (!copy->buf) return 0;
+
+  for (row=0; row < image->rows; row++)
+    memcpy(copy->data + copy->row_stride*row,
+	   image->data + image->row_stride*row, row_size*sizeof(uint16_t));
+
+  return 1;
+}
+
 /* extern */ int x3f_crop_area(uint32_t *coord, x3f_area16_t *image,
 			       x3f_area16_t *crop)
 {
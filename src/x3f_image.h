@@ -14,6 +14,8 @@
 
 extern int x3f_image_area(x3f_t *x3f, x3f_area16_t *image);
 extern int x3f_image_area_qtop(x3f_t *x3f, x3f_area16_t *image);
+/* Allocates a private, compact copy of image, to be free()d via buf */
+extern int x3f_copy_area(x3f_area16_t *image, x3f_area16_t *copy);
 extern int x3f_crop_area(uint32_t *coord, x3f_area16_t *image,
 			 x3f_area16_t *crop);
 extern int x3f_crop_area8(uint32_t *coord, x3f_area8_t *image,
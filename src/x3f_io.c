@@ -9,6 +9,7 @@
 
 #include "x3f_io.h"
 #include "x3f_printf.h"
+#include "x3f_parallel.h"
 
 #include <string.h>
 #include <stdlib.h>
@@ -276,6 +277,8 @@ static x3f_huffman_t *new_huffman(x3f_huffman_t **HUFP)
   x3f_directory_section_t *DS = NULL;
   int i, d;
 
+  x3f->refcount = 1;
+
   I = &x3f->info;
   I->error = NULL;
   I->input.file = infile;
@@ -435,6 +438,14 @@ static void free_camf_entry(camf_entry_t *entry)
   FREE(entry->matrix_dim_entry);
 }
 
+/* extern */ x3f_t *x3f_ref(x3f_t *x3f)
+{
+  if (x3f != NULL)
+    __sync_fetch_and_add(&x3f->refcount, 1);
+
+  return x3f;
+}
+
 /* extern */ x3f_return_t x3f_delete(x3f_t *x3f)
 {
   x3f_directory_section_t *DS;
@@ -443,6 +454,9 @@ static void free_camf_entry(camf_entry_t *entry)
   if (x3f == NULL)
     return X3F_ARGUMENT_ERROR;
 
+  if (__sync_sub_and_fetch(&x3f->refcount, 1) > 0)
+    return X3F_OK;
+
   x3f_printf(DEBUG, "X3F Delete\n");
 
   DS = &x3f->directory_section;
@@ -823,82 +837,242 @@ static int32_t get_true_diff(bit_state_t *BS, x3f_hufftree_t *HTP)
 
 /* TODO: write more about the compression */
 
-static void true_decode_one_color(x3f_image_data_t *ID, int color)
+/* get_true_diff() is kept for CAMF. The color planes are instead
+   decoded with a bit reader that keeps up to 64 bits buffered, and a
+   table that resolves a whole code from the next 8 bits. This avoids
+   the unpredictable branches of walking the tree bit by bit, which
+   would otherwise dominate. */
+
+#define TRUE_LUT_BITS 8
+#define TRUE_MAX_DIFF_BITS 24	/* So a symbol fits in 32 buffered bits */
+
+typedef struct true_lut_s {
+  uint8_t length;		/* Code length, 0 if no such code */
+  uint8_t bits;			/* Size of the difference that follows */
+} true_lut_t;
+
+static void make_true_lut(x3f_true_huffman_t *table, true_lut_t *lut)
+{
+  int i;
+
+  memset(lut, 0, sizeof(true_lut_t) << TRUE_LUT_BITS);
+
+  for (i=0; i<table->size; i++) {
+    x3f_true_huffman_element_t *element = &table->element[i];
+    uint32_t length = element->code_size;
+    uint32_t first, c;
+
+    if (length == 0 || length > TRUE_LUT_BITS || i > TRUE_MAX_DIFF_BITS)
+      continue;
+
+    /* The code is left adjusted, all entries it prefixes map to it */
+    first = element->code & (0xff << (8 - length)) & 0xff;
+    for (c = first; c < first + (1 << (8 - length)); c++) {
+      lut[c].length = length;
+      lut[c].bits = i;
+    }
+  }
+}
+
+typedef struct true_bits_s {
+  uint8_t *next_address, *end_address;
+  uint64_t buf;			/* Next bits, left adjusted */
+  int avail;			/* Valid bits in buf */
+  int failed;			/* Got a code that is not in the table */
+} true_bits_t;
+
+static void set_true_bits(true_bits_t *B, uint8_t *address, uint8_t *end)
+{
+  B->next_address = address;
+  B->end_address = end;
+  B->buf = 0;
+  B->avail = 0;
+  B->failed = 0;
+}
+
+static inline void refill_true_bits(true_bits_t *B)
+{
+  while (B->avail <= 56) {
+    uint64_t byte = B->next_address < B->end_address ? *B->next_address : 0;
+
+    B->buf |= byte << (56 - B->avail);
+    B->next_address++;
+    B->avail += 8;
+  }
+}
+
+/* Same result as get_true_diff() for valid data. After an invalid
+   code there is no telling where the next code starts, so the rest of
+   the stream is decoded as zero differences. */
+static inline int32_t get_true_diff_lut(true_bits_t *B, const true_lut_t *lut)
+{
+  true_lut_t e;
+  int32_t diff;
+
+  if (B->failed) return 0;
+  if (B->avail < 32) refill_true_bits(B);
+
+  e = lut[B->buf >> (64 - TRUE_LUT_BITS)];
+  if (e.length == 0) {
+    /* TODO: Shouldn't this be treated as a fatal error? */
+    x3f_printf(ERR, "Huffman coding got unexpected bit, "
+	       "skipping the rest of the plane\n");
+    B->failed = 1;
+    return 0;
+  }
+
+  /* Written to compile without branches, also for bits == 0 */
+  diff = (int32_t)(((B->buf << e.length) >> 1) >> (63 - e.bits));
+  B->buf <<= e.length + e.bits;
+  B->avail -= e.length + e.bits;
+
+  /* A leading zero means a negative difference */
+  if (diff < ((1 << e.bits) >> 1))
+    diff -= (1 << e.bits) - 1;
+
+  return diff;
+}
+
+/* State of the decoding of one color plane. The planes are coded as
+   separate bitstreams, so they can be decoded independently. */
+typedef struct true_stream_s {
+  true_bits_t B;
+  x3f_area16_t *area;
+  uint16_t *dst;
+  uint32_t rows, cols;
+  uint32_t row, col;
+  uint32_t left;		/* Symbols left to decode */
+  int32_t row_start_acc[2][2];
+  int32_t acc[2];
+} true_stream_t;
+
+static void true_stream_init(x3f_image_data_t *ID, int color,
+			     true_stream_t *S)
 {
   x3f_true_t *TRU = ID->tru;
   x3f_quattro_t *Q = ID->quattro;
   uint32_t seed = TRU->seed[color]; /* TODO : Is this correct ? */
-  int row;
-
-  x3f_hufftree_t *tree = &TRU->tree;
-  bit_state_t BS;
 
-  int32_t row_start_acc[2][2];
-  uint32_t rows = ID->rows;
-  uint32_t cols = ID->columns;
-  x3f_area16_t *area = &TRU->x3rgb16;
-  uint16_t *dst = area->data + color;
+  S->rows = ID->rows;
+  S->cols = ID->columns;
+  S->area = &TRU->x3rgb16;
+  S->dst = S->area->data + color;
 
-  set_bit_state(&BS, TRU->plane_address[color]);
+  set_true_bits(&S->B, TRU->plane_address[color],
+		ID->data + ID->data_size);
 
-  row_start_acc[0][0] = seed;
-  row_start_acc[0][1] = seed;
-  row_start_acc[1][0] = seed;
-  row_start_acc[1][1] = seed;
+  S->row_start_acc[0][0] = seed;
+  S->row_start_acc[0][1] = seed;
+  S->row_start_acc[1][0] = seed;
+  S->row_start_acc[1][1] = seed;
 
   if (ID->type_format == X3F_IMAGE_RAW_QUATTRO ||
       ID->type_format == X3F_IMAGE_RAW_SDQ) {
-    rows = Q->plane[color].rows;
-    cols = Q->plane[color].columns;
+    S->rows = Q->plane[color].rows;
+    S->cols = Q->plane[color].columns;
 
     if (Q->quattro_layout && color == 2) {
-      area = &Q->top16;
-      dst = area->data;
+      S->area = &Q->top16;
+      S->dst = S->area->data;
     }
     x3f_printf(DEBUG, "Quattro decode one color (%d) rows=%d cols=%d\n",
-	       color, rows, cols);
+	       color, S->rows, S->cols);
   } else {
     x3f_printf(DEBUG, "TRUE decode one color (%d) rows=%d cols=%d\n",
-	       color, rows, cols);
+	       color, S->rows, S->cols);
   }
 
-  assert(rows == area->rows && cols >= area->columns);
+  assert(S->rows == S->area->rows && S->cols >= S->area->columns);
 
-  for (row = 0; row < rows; row++) {
-    int col;
-    bool_t odd_row = row&1;
-    int32_t acc[2];
+  S->row = 0;
+  S->col = 0;
+  S->left = S->rows*S->cols;
+}
 
-    for (col = 0; col < cols; col++) {
-      bool_t odd_col = col&1;
-      int32_t diff = get_true_diff(&BS, tree);
-      int32_t prev = col < 2 ?
-	row_start_acc[odd_row][odd_col] :
-	acc[odd_col];
-      int32_t value = prev + diff;
+/* Add the next decoded difference to the stream */
+static inline void true_stream_put(true_stream_t *S, int32_t diff)
+{
+  bool_t odd_row = S->row&1;
+  bool_t odd_col = S->col&1;
+  int32_t prev = S->col < 2 ?
+    S->row_start_acc[odd_row][odd_col] :
+    S->acc[odd_col];
+  int32_t value = prev + diff;
 
-      acc[odd_col] = value;
-      if (col < 2)
-	row_start_acc[odd_row][odd_col] = value;
+  S->acc[odd_col] = value;
+  if (S->col < 2)
+    S->row_start_acc[odd_row][odd_col] = value;
 
-      /* Discard additional data at the right for binned Quattro plane 2 */
-      if (col >= area->columns) continue;
+  /* Discard additional data at the right for binned Quattro plane 2 */
+  if (S->col < S->area->columns) {
+    *S->dst = value;
+    S->dst += S->area->channels;
+  }
 
-      *dst = value;
-      dst += area->channels;
-    }
+  if (++S->col == S->cols) {
+    S->col = 0;
+    S->row++;
   }
+  S->left--;
+}
+
+static void true_decode_one_color(true_stream_t *S, const true_lut_t *lut)
+{
+  while (S->left > 0)
+    true_stream_put(S, get_true_diff_lut(&S->B, lut));
 }
 
+/* Each symbol depends on the bit position left by the previous one
+   in the same plane, so decoding one plane at a time is bound by the
+   latency of that chain. Decoding the three planes in lock-step gives
+   the CPU three independent chains to overlap. Whatever is left of
+   the larger planes, e.g. the Quattro top layer, is then decoded the
+   same way with the planes that still have data. */
 static void true_decode(x3f_info_t *I,
 			x3f_directory_entry_t *DE)
 {
   x3f_directory_entry_header_t *DEH = &DE->header;
   x3f_image_data_t *ID = &DEH->data_subsection.image_data;
-  int color;
+  true_lut_t lut[1 << TRUE_LUT_BITS];
+  true_stream_t S[TRUE_PLANES], *active[TRUE_PLANES];
+  int num, color;
+
+  make_true_lut(&ID->tru->table, lut);
+
+  for (color = 0; color < TRUE_PLANES; color++)
+    true_stream_init(ID, color, &S[color]);
+
+  for (;;) {
+    uint32_t n = UINT32_MAX;
+
+    for (num = 0, color = 0; color < TRUE_PLANES; color++)
+      if (S[color].left > 0) {
+	active[num++] = &S[color];
+	if (S[color].left < n) n = S[color].left;
+      }
 
-  for (color = 0; color < 3; color++) {
-    true_decode_one_color(ID, color);
+    if (num == 3)
+      while (n-- > 0) {
+	int32_t diff0 = get_true_diff_lut(&active[0]->B, lut);
+	int32_t diff1 = get_true_diff_lut(&active[1]->B, lut);
+	int32_t diff2 = get_true_diff_lut(&active[2]->B, lut);
+
+	true_stream_put(active[0], diff0);
+	true_stream_put(active[1], diff1);
+	true_stream_put(active[2], diff2);
+      }
+    else if (num == 2)
+      while (n-- > 0) {
+	int32_t diff0 = get_true_diff_lut(&active[0]->B, lut);
+	int32_t diff1 = get_true_diff_lut(&active[1]->B, lut);
+
+	true_stream_put(active[0], diff0);
+	true_stream_put(active[1], diff1);
+      }
+    else if (num == 1)
+      true_decode_one_color(active[0], lut);
+    else
+      break;
   }
 }
 
@@ -997,94 +1171,149 @@ static void huffman_decode(x3f_info_t *I,
   }
 }
 
-static int32_t get_simple_diff(x3f_huffman_t *HUF, uint16_t index)
+/* The rows of uncompressed data are independent, so they are decoded
+   in bands of rows on several threads */
+#define SIMPLE_BAND_ROWS 64
+
+typedef struct simple_job_s {
+  x3f_image_data_t *ID;
+  int bits;
+  int row_stride;
+  uint32_t mask;
+  uint16_t map[1<<12];		/* Mapping, or identity if there is none */
+} simple_job_t;
+
+/* The three colors are packed into one 32 bit word per pixel and each
+   color is the running sum of its mapped differences along the row.
+   The sums are kept in separate variables, so that the three chains
+   are independent, and the type of output is decided once per row
+   instead of per sample. */
+static void simple_decode_row(simple_job_t *job, int row)
 {
-  if (HUF->mapping.size == 0)
-    return index;
-  else
-    return HUF->mapping.element[index];
+  x3f_image_data_t *ID = job->ID;
+  x3f_huffman_t *HUF = ID->huffman;
+  uint32_t *data = (uint32_t *)(ID->data + row*job->row_stride);
+  const uint16_t *map = job->map;
+  uint32_t mask = job->mask;
+  int bits = job->bits;
+  uint32_t cols = ID->columns;
+  uint16_t c0 = 0, c1 = 0, c2 = 0;
+  uint32_t col;
+
+  switch (ID->type_format) {
+  case X3F_IMAGE_RAW_HUFFMAN_X530:
+  case X3F_IMAGE_RAW_HUFFMAN_10BIT:
+    {
+      uint16_t *dst = HUF->x3rgb16.data + 3*row*cols;
+
+      for (col = 0; col < cols; col++, dst += 3) {
+	uint32_t val = data[col];
+
+	c0 += map[val & mask];
+	c1 += map[(val>>bits) & mask];
+	c2 += map[(val>>(2*bits)) & mask];
+
+	dst[0] = (int16_t)c0 > 0 ? c0 : 0;
+	dst[1] = (int16_t)c1 > 0 ? c1 : 0;
+	dst[2] = (int16_t)c2 > 0 ? c2 : 0;
+      }
+    }
+    break;
+  case X3F_IMAGE_THUMB_HUFFMAN:
+    {
+      uint8_t *dst = HUF->rgb8.data + 3*row*cols;
+
+      for (col = 0; col < cols; col++, dst += 3) {
+	uint32_t val = data[col];
+
+	c0 += map[val & mask];
+	c1 += map[(val>>bits) & mask];
+	c2 += map[(val>>(2*bits)) & mask];
+
+	dst[0] = (int8_t)c0 > 0 ? c0 : 0;
+	dst[1] = (int8_t)c1 > 0 ? c1 : 0;
+	dst[2] = (int8_t)c2 > 0 ? c2 : 0;
+      }
+    }
+    break;
+  default:
+    break;
+  }
 }
 
-static void simple_decode_row(x3f_info_t *I,
-                              x3f_directory_entry_t *DE,
-                              int bits,
-                              int row,
-                              int row_stride)
+static void simple_decode_band(void *arg, int index)
+{
+  simple_job_t *job = (simple_job_t *)arg;
+  int row = index*SIMPLE_BAND_ROWS;
+  int end = row + SIMPLE_BAND_ROWS < job->ID->rows ?
+    row + SIMPLE_BAND_ROWS : job->ID->rows;
+
+  for (; row < end; row++)
+    simple_decode_row(job, row);
+}
+
+static void simple_decode(x3f_info_t *I,
+                          x3f_directory_entry_t *DE,
+                          int bits,
+                          int row_stride)
 {
   x3f_directory_entry_header_t *DEH = &DE->header;
   x3f_image_data_t *ID = &DEH->data_subsection.image_data;
   x3f_huffman_t *HUF = ID->huffman;
+  simple_job_t *job;
+  uint32_t i;
 
-  uint32_t *data = (uint32_t *)(ID->data + row*row_stride);
+  switch (ID->type_format) {
+  case X3F_IMAGE_RAW_HUFFMAN_X530:
+  case X3F_IMAGE_RAW_HUFFMAN_10BIT:
+  case X3F_IMAGE_THUMB_HUFFMAN:
+    break;
+  default:
+    /* TODO: Shouldn't this be treated as a fatal error? */
+    x3f_printf(ERR, "Unknown huffman image type\n");
+    return;
+  }
 
-  uint16_t c[3] = {0,0,0};
-  int col;
+  job = (simple_job_t *)malloc(sizeof(simple_job_t));
+  if (job == NULL) {
+    x3f_printf(ERR, "Could not allocate memory for decoding\n");
+    return;
+  }
 
-  uint32_t mask = 0;
+  job->ID = ID;
+  job->bits = bits;
+  job->row_stride = row_stride;
 
   switch (bits) {
   case 8:
-    mask = 0x0ff;
+    job->mask = 0x0ff;
     break;
   case 9:
-    mask = 0x1ff;
+    job->mask = 0x1ff;
     break;
   case 10:
-    mask = 0x3ff;
+    job->mask = 0x3ff;
     break;
   case 11:
-    mask = 0x7ff;
+    job->mask = 0x7ff;
     break;
   case 12:
-    mask = 0xfff;
+    job->mask = 0xfff;
     break;
   default:
     /* TODO: Shouldn't this be treated as a fatal error? */
     x3f_printf(ERR, "Unknown number of bits: %d\n", bits);
-    mask = 0;
+    job->mask = 0;
     break;
   }
 
-  for (col = 0; col < ID->columns; col++) {
-    int color;
-    uint32_t val = data[col];
-
-    for (color = 0; color < 3; color++) {
-      uint16_t c_fix;
-      c[color] += get_simple_diff(HUF, (val>>(color*bits))&mask);
-
-      switch (ID->type_format) {
-      case X3F_IMAGE_RAW_HUFFMAN_X530:
-      case X3F_IMAGE_RAW_HUFFMAN_10BIT:
-        c_fix = (int16_t)c[color] > 0 ? c[color] : 0;
-
-        HUF->x3rgb16.data[3*(row*ID->columns + col) + color] = c_fix;
-        break;
-      case X3F_IMAGE_THUMB_HUFFMAN:
-        c_fix = (int8_t)c[color] > 0 ? c[color] : 0;
-
-        HUF->rgb8.data[3*(row*ID->columns + col) + color] = c_fix;
-        break;
-      default:
-	/* TODO: Shouldn't this be treated as a fatal error? */
-        x3f_printf(ERR, "Unknown huffman image type\n");
-      }
-    }
-  }
-}
-
-static void simple_decode(x3f_info_t *I,
-                          x3f_directory_entry_t *DE,
-                          int bits,
-                          int row_stride)
-{
-  x3f_directory_entry_header_t *DEH = &DE->header;
-  x3f_image_data_t *ID = &DEH->data_subsection.image_data;
+  for (i = 0; i <= job->mask; i++)
+    job->map[i] = HUF->mapping.size == 0 ? i : HUF->mapping.element[i];
 
-  int row;
+  x3f_parallel_for((ID->rows + SIMPLE_BAND_ROWS - 1)/SIMPLE_BAND_ROWS,
+		   simple_decode_band, job);
 
-  for (row = 0; row < ID->rows; row++)
-    simple_decode_row(I, DE, bits, row, row_stride);
+  free(job);
 }
 
 /* --------------------------------------------------------------------- */
@@ -428,6 +428,7 @@ typedef struct x3f_s {
   x3f_info_t info;
   x3f_header_t header;
   x3f_directory_section_t directory_section;
+  int refcount;			/* See x3f_ref() */
 } x3f_t;
 
 typedef enum x3f_return_e {
@@ -443,8 +444,16 @@ extern bool_t auto_legacy_offset;
 
 extern x3f_t *x3f_new_from_file(FILE *infile);
 
+/* Drops one reference, the last one frees all data */
 extern x3f_return_t x3f_delete(x3f_t *x3f);
 
+/* Takes one more reference to x3f. The loaded and decoded data is
+   never modified by the processing functions, so once everything
+   needed is loaded, several threads holding a reference each may
+   render from the same x3f concurrently. Loading must not overlap
+   with anything else. */
+extern x3f_t *x3f_ref(x3f_t *x3f);
+
 extern x3f_directory_entry_t *x3f_get_raw(x3f_t *x3f);
 
 extern x3f_directory_entry_t *x3f_get_thumb_plain(x3f_t *x3f);
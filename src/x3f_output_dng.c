@@ -2,6 +2,12 @@
  *
  * Library for writing the image as DNG.
  *
+ * The DNG file is laid out completely in memory before anything is
+ * written. Raw strips are compressed up front if needed, so all
+ * offsets are known and the file is emitted strictly front to
+ * back. No seeking is ever done on the output stream, which thus can
+ * be a pipe or a socket.
+ *
  * Copyright 2015 - Roland and Erik Karlsson
  * BSD-style - see doc/copyright.txt
  *
@@ -9,30 +15,24 @@
 
 #include "x3f_output_dng.h"
 #include "x3f_process.h"
+#include "x3f_tiff_ifd.h"
 #include "x3f_dngtags.h"
 #include "x3f_matrix.h"
 #include "x3f_meta.h"
 #include "x3f_image.h"
 #include "x3f_spatial_gain.h"
+#include "x3f_parallel.h"
 #include "x3f_printf.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <tiffio.h>
+#include <zlib.h>
 #include <math.h>
 #include <string.h>
 #include <assert.h>
 
-static void vec_double_to_float(double *a, float *b, int len)
-{
-  int i;
-
-  for (i=0; i<len; i++)
-    b[i] = a[i];
-}
-
 static int get_camf_rect_as_dngrect(x3f_t *x3f, char *name,
 				    x3f_area16_t *image, int rescale,
 				    uint32_t *rect)
@@ -52,7 +52,7 @@ static int get_camf_rect_as_dngrect(x3f_t *x3f, char *name,
 }
 
 static int write_spatial_gain(x3f_t *x3f, x3f_area16_t *image, char *wb,
-			      TIFF *tiff)
+			      x3f_tiff_ifd_t *ifd)
 {
   x3f_spatial_gain_corr_t corr[MAXCORR];
   int corr_num;
@@ -123,7 +123,8 @@ static int write_spatial_gain(x3f_t *x3f, x3f_area16_t *image, char *wb,
 
   x3f_cleanup_spatial_gain(corr, corr_num);
 
-  TIFFSetField(tiff, TIFFTAG_OPCODELIST2, opcode_list_size, opcode_list);
+  x3f_tiff_set_undefined(ifd, TIFFTAG_OPCODELIST2,
+			 opcode_list_size, opcode_list);
 
   return 1;
 }
@@ -154,20 +155,20 @@ static const camera_profile_t camera_profiles[] = {
   {"Unconverted", get_bmt_to_xyz_noconvert, NULL},
 };
 
+#define NUM_PROFILES (sizeof(camera_profiles)/sizeof(camera_profile_t))
+
 static int write_camera_profile(x3f_t *x3f, char *wb,
 				const camera_profile_t *profile,
-				TIFF *tiff)
+				x3f_tiff_ifd_t *ifd)
 {
   double bmt_to_xyz[9], xyz_to_bmt[9], bmt_to_d50[9];
-  float color_matrix1[9], forward_matrix1[9];
 
   if (!profile->get_bmt_to_xyz(x3f, wb, bmt_to_xyz)) {
     x3f_printf(ERR, "Could not get bmt_to_xyz for white balance: %s\n", wb);
     return 0;
   }
   x3f_3x3_inverse(bmt_to_xyz, xyz_to_bmt);
-  vec_double_to_float(xyz_to_bmt, color_matrix1, 9);
-  TIFFSetField(tiff, TIFFTAG_COLORMATRIX1, 9, color_matrix1);
+  x3f_tiff_set_srational(ifd, TIFFTAG_COLORMATRIX1, 9, xyz_to_bmt);
 
   if (profile->grayscale_mix) {
     double d50_xyz[3] = {0.96422, 1.00000, 0.82521};
@@ -185,134 +186,286 @@ static int write_camera_profile(x3f_t *x3f, char *wb,
     x3f_Bradford_D65_to_D50(d65_to_d50);
     x3f_3x3_3x3_mul(d65_to_d50, bmt_to_xyz, bmt_to_d50);
   }
-  vec_double_to_float(bmt_to_d50, forward_matrix1, 9);
-  TIFFSetField(tiff, TIFFTAG_FORWARDMATRIX1, 9, forward_matrix1);
+  x3f_tiff_set_srational(ifd, TIFFTAG_FORWARDMATRIX1, 9, bmt_to_d50);
 
-  TIFFSetField(tiff, TIFFTAG_PROFILENAME, profile->name);
+  x3f_tiff_set_ascii(ifd, TIFFTAG_PROFILENAME, profile->name);
   /* Tell the raw converter to refrain from clipping the dark areas */
-  TIFFSetField(tiff, TIFFTAG_DEFAULTBLACKRENDER, 1);
+  x3f_tiff_set_long1(ifd, TIFFTAG_DEFAULTBLACKRENDER, 1);
 
   return 1;
 }
 
-#if defined(_WIN32) || defined (_WIN64)
-/* tmpfile() is broken on Windows */
-#include <windows.h>
+/* Extra camera profiles are stored as separate, TIFF-like, big endian
+   blocks with the magic "MMCR". Offsets within a block are relative
+   to the start of the block. */
 
-#define tmpfile tmpfile_win
-static FILE *tmpfile_win(void)
+#define DNG_PROFILE_MAGIC 0x4352 /* "CR" */
+
+static uint32_t profile_block_size(x3f_tiff_ifd_t *ifd)
 {
-  char dir[MAX_PATH], file[MAX_PATH];
-  HANDLE h;
+  return X3F_TIFF_HEADER_SIZE + x3f_tiff_ifd_size(ifd);
+}
 
-  if (!GetTempPath(MAX_PATH, dir)) return NULL;
-  if (!GetTempFileName(dir, "x3f", 0, file)) return NULL;
+static void profile_block_write(x3f_tiff_ifd_t *ifd, uint8_t *buf)
+{
+  x3f_tiff_header_write(buf, DNG_PROFILE_MAGIC, X3F_TIFF_HEADER_SIZE, 1);
+  x3f_tiff_ifd_write(ifd, buf + X3F_TIFF_HEADER_SIZE,
+		     X3F_TIFF_HEADER_SIZE, 0, 1);
+}
+
+#define ROWS_PER_STRIP 32
+
+typedef struct {
+  uint8_t *data;
+  uint32_t size;
+} dng_strip_t;
 
-  h = CreateFile(file, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
-		 FILE_ATTRIBUTE_NORMAL | FILE_FLAG_DELETE_ON_CLOSE, NULL);
-  if (h == INVALID_HANDLE_VALUE) return NULL;
+/* State shared by all threads encoding strips */
+typedef struct {
+  x3f_area16_t *image;
+  int bits;			/* 8 ... 16 bits per sample */
+  uint16_t *encode;		/* LinearizationTable inverse, or NULL */
+  int compress;
+  int first;			/* Strip of index 0 */
+  dng_strip_t *strips;
+  int error;
+} dng_strip_job_t;
+
+static uint32_t strip_rows(x3f_area16_t *image, int strip)
+{
+  uint32_t row0 = strip*ROWS_PER_STRIP;
 
-  return fdopen(_open_osfhandle((intptr_t)h, O_RDWR | O_BINARY), "w+b");
+  return image->rows - row0 < ROWS_PER_STRIP ?
+    image->rows - row0 : ROWS_PER_STRIP;
 }
-#endif
 
-static x3f_return_t write_camera_profiles(x3f_t *x3f, char *wb,
-					  const camera_profile_t *profiles,
-					  int num,
-					  TIFF *tiff)
+/* Each row starts on a byte boundary */
+static uint32_t row_bytes(x3f_area16_t *image, int bits)
 {
-  FILE *tiff_file;
-  uint32_t *profile_offsets;
-  int i;
+  return (image->columns*image->channels*bits + 7)/8;
+}
 
-  assert(num >= 1);
-  if (!write_camera_profile(x3f, wb, &profiles[0], tiff))
-    return X3F_ARGUMENT_ERROR;
-  TIFFSetField(tiff, TIFFTAG_ASSHOTPROFILENAME, profiles[0].name);
-  if (num == 1) return X3F_OK;
+/* Pack one row of samples, most significant bit first as required by
+   TIFF for sample sizes that are not a multiple of eight. Samples
+   above the largest code are clipped; they are above WhiteLevel
+   anyway. */
+static void pack_row(const uint16_t *src, uint32_t num, int bits,
+		     const uint16_t *encode, uint8_t *dst)
+{
+  uint32_t max_code = (1<<bits) - 1;
+  uint32_t acc = 0;
+  int acc_bits = 0;
+  uint32_t i = 0;
+
+#define CODE(_v) (encode ? encode[_v] : (_v) > max_code ? max_code : (_v))
+
+  /* Fast path for even sizes: four samples fill exactly bits/2 bytes,
+     so the groups can be combined in a 64-bit word without any carry
+     between them */
+  if (!(bits & 1)) {
+    int bytes = bits/2;
+
+    for (; i + 4 <= num; i += 4, dst += bytes) {
+      uint64_t w =
+	(uint64_t)CODE(src[i+0]) << 3*bits |
+	(uint64_t)CODE(src[i+1]) << 2*bits |
+	(uint64_t)CODE(src[i+2]) << 1*bits |
+	(uint64_t)CODE(src[i+3]);
+      int b;
+
+      for (b=0; b < bytes; b++)
+	dst[b] = w >> 8*(bytes - 1 - b);
+    }
+  }
 
-  profile_offsets = alloca((num-1)*sizeof(uint32_t));
+  for (; i < num; i++) {
+    acc = acc << bits | CODE(src[i]);
+    acc_bits += bits;
+    while (acc_bits >= 8) {
+      acc_bits -= 8;
+      *dst++ = acc >> acc_bits;
+    }
+  }
 
-  tiff_file = fdopen(dup(TIFFFileno(tiff)), "w+b");
-  if (!tiff_file) return X3F_OUTFILE_ERROR;
+  if (acc_bits > 0)
+    *dst = acc << (8 - acc_bits);
 
-  for (i=1; i < num; i++) {
-    FILE *tmp;
-    TIFF *tmp_tiff;
-#define BUFSIZE 1024
-    char buf[BUFSIZE];
-    int offset, count;
+#undef CODE
+}
 
-    if (!(tmp = tmpfile())) {
-      fclose(tiff_file);
-      return X3F_OUTFILE_ERROR;
-    }
-    if (!(tmp_tiff = TIFFFdOpen(dup(fileno(tmp)), "", "wb"))) { /* Big endian */
-      fclose(tmp);
-      fclose(tiff_file);
-      return X3F_OUTFILE_ERROR;
-    }
-    if (!write_camera_profile(x3f, wb, &profiles[i], tmp_tiff)) {
-      fclose(tmp);
-      TIFFClose(tmp_tiff);
-      fclose(tiff_file);
-      return X3F_ARGUMENT_ERROR;
+/* Pack the rows of one strip contiguously. 16-bit samples are
+   stored little endian like the rest of the file. */
+static uint32_t pack_strip(dng_strip_job_t *job, int strip, uint8_t *buf)
+{
+  x3f_area16_t *image = job->image;
+  uint32_t row0 = strip*ROWS_PER_STRIP;
+  uint32_t rows = strip_rows(image, strip);
+  uint32_t row_size = image->columns*image->channels;
+  uint32_t size = row_bytes(image, job->bits);
+  int swap = x3f_tiff_host_is_big_endian();
+  int row;
+
+  for (row=0; row < rows; row++) {
+    uint16_t *src = image->data + image->row_stride*(row0 + row);
+    uint8_t *dst = buf + size*row;
+
+    if (job->bits < 16)
+      pack_row(src, row_size, job->bits, job->encode, dst);
+    else if (swap) {
+      int i;
+
+      for (i=0; i < row_size; i++) {
+	dst[2*i + 0] = src[i] >> 0;
+	dst[2*i + 1] = src[i] >> 8;
+      }
     }
-    TIFFWriteDirectory(tmp_tiff);
-    TIFFClose(tmp_tiff);
+    else memcpy(dst, src, sizeof(uint16_t)*row_size);
+  }
 
-    fseek(tiff_file, 0, SEEK_END);
-    offset = (ftell(tiff_file)+1) & ~1; /* 2-byte alignment */
-    fseek(tiff_file, offset, SEEK_SET);
-    profile_offsets[i-1] = offset;
+  return size*rows;
+}
+
+static void encode_strip(void *arg, int index)
+{
+  dng_strip_job_t *job = (dng_strip_job_t *)arg;
+  int strip = job->first + index;
+  dng_strip_t *s = &job->strips[strip];
+  uint8_t *buf = malloc(row_bytes(job->image, job->bits)*ROWS_PER_STRIP);
+  uLong size = pack_strip(job, strip, buf);
+  uLongf csize;
+
+  if (!job->compress) {
+    s->data = buf;
+    s->size = size;
+    return;
+  }
+
+  csize = compressBound(size);
+  s->data = malloc(csize);
+  if (compress2(s->data, &csize, buf, size, Z_DEFAULT_COMPRESSION) != Z_OK) {
+    x3f_printf(ERR, "Could not compress DNG strip %d\n", strip);
+    job->error = 1;
+  }
+  s->size = csize;
+  free(buf);
+}
+
+/* Encode strips [first, first+num) in parallel */
+static int encode_strips(dng_strip_job_t *job, int first, int num)
+{
+  job->first = first;
+  x3f_parallel_for(num, encode_strip, job);
+
+  return !job->error;
+}
+
+static void free_strips(dng_strip_t *strips, int first, int num)
+{
+  int i;
+
+  for (i=first; i < first + num; i++) {
+    free(strips[i].data);
+    strips[i].data = NULL;
+  }
+}
 
-    fputs("MMCR", tiff_file);	/* DNG camera profile magic in big endian */
-    fseek(tmp, 4, SEEK_SET);	/* Skip over the standard TIFF magic */
+/* Smallest number of bits that can represent val */
+static int bits_needed(uint32_t val)
+{
+  int bits = 1;
 
-    while((count = fread(buf, 1, BUFSIZE, tmp)))
-      fwrite(buf, 1, count, tiff_file);
+  while (bits < 16 && val >> bits) bits++;
 
-    fclose(tmp);
+  return bits;
+}
+
+/* For storing fewer bits than significant, the codes are spread out
+   with a square curve. The step between two codes then grows with
+   the signal like the photon shot noise, so the quantization error
+   stays well below the noise level everywhere. table maps codes to
+   linear values, encode maps linear values to the nearest code. */
+static void make_linearization(uint32_t max_val, int bits,
+			       uint16_t *table, uint16_t *encode)
+{
+  uint32_t max_code = (1<<bits) - 1;
+  uint32_t c, v;
+
+  for (c=0; c <= max_code; c++) {
+    double x = (double)c/max_code;
+    table[c] = (uint16_t)round(max_val*x*x);
   }
 
-  fclose(tiff_file);
-  TIFFSetField(tiff, TIFFTAG_EXTRACAMERAPROFILES, num-1, profile_offsets);
-  return X3F_OK;
+  for (v=0, c=0; v < 65536; v++) {
+    if (v >= max_val) {
+      encode[v] = max_code;
+      continue;
+    }
+    while (c < max_code && table[c+1] <= v) c++;
+    encode[v] = c < max_code && table[c+1] - v < v - table[c] ? c+1 : c;
+  }
 }
 
-#if defined(_WIN32) || defined(_WIN64)
-#define BINMODE O_BINARY
-#else
-#define BINMODE 0
-#endif
+/* The raw data is never rotated physically, since ActiveArea and the
+   spatial gain maps refer to the sensor. Instead, the reader is told
+   how to rotate the image, which DNG readers are required to do. */
+static uint16_t get_orientation(int rotation)
+{
+  switch (rotation) {
+  case 0:   return ORIENTATION_TOPLEFT;
+  case 90:  return ORIENTATION_RIGHTTOP;
+  case 180: return ORIENTATION_BOTRIGHT;
+  case 270: return ORIENTATION_LEFTBOT;
+  default:  return 0;
+  }
+}
+
+static int write_all(FILE *f_out, const void *buf, size_t size)
+{
+  return fwrite(buf, 1, size, f_out) == size;
+}
 
 /* extern */
-x3f_return_t x3f_dump_raw_data_as_dng(x3f_t *x3f,
-				      char *outfilename,
-				      int denoise,
-				      int apply_sgain,
-				      char *wb,
-				      int compress)
+x3f_return_t x3f_dump_raw_data_as_dng_stream(x3f_t *x3f,
+					     FILE *f_out,
+					     int denoise,
+					     int apply_sgain,
+					     char *wb,
+					     int compress,
+					     int bits,
+					     int rotation)
 {
-  x3f_return_t ret;
-  int fd = open(outfilename, O_RDWR | BINMODE | O_CREAT | O_TRUNC, 0444);
-  TIFF *f_out;
-  uint64_t sub_ifds[1] = {0};
+  x3f_return_t ret = X3F_OK;
+  x3f_tiff_ifd_t ifd0, sub_ifd, profile_ifd[NUM_PROFILES];
+  uint32_t profile_offsets[NUM_PROFILES] = {0};
+  uint8_t dng_version[4] = {1, 4, 0, 0};
+  uint8_t dng_backward_version[4] = {1, 3, 0, 0};
+  uint16_t bits_preview[3] = {8, 8, 8}, bits_image[3];
 
   double sensor_iso, capture_iso;
   double gain[3], gain_inv[3], gain_inv_mat[9];
-  float as_shot_neutral[3], camera_calibration1[9];
-  float black_level[3];
+  double black_level[3], chroma_blur_radius = 0.0;
   uint32_t active_area[4];
   x3f_area16_t image;
   x3f_image_levels_t ilevels;
   x3f_area8_t preview;
-  int row;
 
-  if (fd == -1) return X3F_OUTFILE_ERROR;
-  if (!(f_out = TIFFFdOpen(fd, outfilename, "w"))) {
-    close(fd);
-    return X3F_OUTFILE_ERROR;
+  dng_strip_job_t job;
+  dng_strip_t *strips = NULL;
+  uint32_t *strip_offsets = NULL, *strip_sizes = NULL;
+  uint32_t num_strips = 0, max_white;
+  uint16_t *table = NULL, *encode = NULL;
+  uint8_t *head = NULL;
+  uint32_t sub_ifd_offset, preview_offset, preview_size, head_size, offset;
+  int row, i, batch;
+  uint16_t orientation;
+
+  if (bits != 0 && (bits < 8 || bits > 16)) {
+    x3f_printf(ERR, "Unsupported DNG bit depth: %d\n", bits);
+    return X3F_ARGUMENT_ERROR;
+  }
+  if (!(orientation = get_orientation(rotation))) {
+    x3f_printf(ERR, "Unsupported rotation: %d\n", rotation);
+    return X3F_ARGUMENT_ERROR;
   }
 
   if (wb == NULL) wb = x3f_get_wb(x3f);
@@ -320,109 +473,278 @@ x3f_return_t x3f_dump_raw_data_as_dng(x3f_t *x3f,
 		     denoise, apply_sgain, wb) ||
       image.channels != 3) {
     x3f_printf(ERR, "Could not get image\n");
-    TIFFClose(f_out);
     return X3F_ARGUMENT_ERROR;
   }
   if (!x3f_get_preview(x3f, &image, &ilevels, SRGB,
 		       apply_sgain, wb, 300, &preview)) {
     x3f_printf(ERR, "Could not get preview\n");
-    TIFFClose(f_out);
     free(image.buf);
     return X3F_ARGUMENT_ERROR;
   }
 
-  TIFFSetField(f_out, TIFFTAG_SUBFILETYPE, FILETYPE_REDUCEDIMAGE);
-  TIFFSetField(f_out, TIFFTAG_IMAGEWIDTH, preview.columns);
-  TIFFSetField(f_out, TIFFTAG_IMAGELENGTH, preview.rows);
-  TIFFSetField(f_out, TIFFTAG_ROWSPERSTRIP, preview.rows);
-  TIFFSetField(f_out, TIFFTAG_SAMPLESPERPIXEL, preview.channels);
-  TIFFSetField(f_out, TIFFTAG_BITSPERSAMPLE, 8);
-  TIFFSetField(f_out, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
-  TIFFSetField(f_out, TIFFTAG_COMPRESSION, COMPRESSION_NONE);
-  TIFFSetField(f_out, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
-  TIFFSetField(f_out, TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT);
-  TIFFSetField(f_out, TIFFTAG_DNGVERSION, "\001\004\000\000");
-  TIFFSetField(f_out, TIFFTAG_DNGBACKWARDVERSION,
-	       compress ? "\001\004\000\000" : "\001\003\000\000");
-  TIFFSetField(f_out, TIFFTAG_SUBIFD, 1, sub_ifds);
+  x3f_tiff_ifd_init(&ifd0);
+  x3f_tiff_ifd_init(&sub_ifd);
+  for (i=0; i < NUM_PROFILES; i++)
+    x3f_tiff_ifd_init(&profile_ifd[i]);
+
+  /* BEGIN - IFD0, i.e. the preview plus all camera metadata */
+
+  preview_size = preview.rows*preview.columns*preview.channels;
+
+  x3f_tiff_set_long1(&ifd0, TIFFTAG_SUBFILETYPE, FILETYPE_REDUCEDIMAGE);
+  x3f_tiff_set_long1(&ifd0, TIFFTAG_IMAGEWIDTH, preview.columns);
+  x3f_tiff_set_long1(&ifd0, TIFFTAG_IMAGELENGTH, preview.rows);
+  x3f_tiff_set_short(&ifd0, TIFFTAG_BITSPERSAMPLE, 3, bits_preview);
+  x3f_tiff_set_short1(&ifd0, TIFFTAG_COMPRESSION, COMPRESSION_NONE);
+  x3f_tiff_set_short1(&ifd0, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
+  x3f_tiff_set_long1(&ifd0, TIFFTAG_STRIPOFFSETS, 0); /* Set below */
+  x3f_tiff_set_short1(&ifd0, TIFFTAG_ORIENTATION, orientation);
+  x3f_tiff_set_short1(&ifd0, TIFFTAG_SAMPLESPERPIXEL, preview.channels);
+  x3f_tiff_set_long1(&ifd0, TIFFTAG_ROWSPERSTRIP, preview.rows);
+  x3f_tiff_set_long1(&ifd0, TIFFTAG_STRIPBYTECOUNTS, preview_size);
+  x3f_tiff_set_short1(&ifd0, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+  x3f_tiff_set_long1(&ifd0, TIFFTAG_SUBIFD, 0); /* Set below */
+  x3f_tiff_set_byte(&ifd0, TIFFTAG_DNGVERSION, 4, dng_version);
+  x3f_tiff_set_byte(&ifd0, TIFFTAG_DNGBACKWARDVERSION, 4,
+		    compress ? dng_version : dng_backward_version);
 
   if (x3f_get_camf_float(x3f, "SensorISO", &sensor_iso) &&
       x3f_get_camf_float(x3f, "CaptureISO", &capture_iso)) {
     double baseline_exposure = log2(capture_iso/sensor_iso);
-    TIFFSetField(f_out, TIFFTAG_BASELINEEXPOSURE, baseline_exposure);
+    x3f_tiff_set_srational(&ifd0, TIFFTAG_BASELINEEXPOSURE,
+			   1, &baseline_exposure);
   }
 
-  ret = write_camera_profiles(x3f, wb, camera_profiles,
-			      sizeof(camera_profiles)/sizeof(camera_profile_t),
-			      f_out);
-  if (ret != X3F_OK) {
-    x3f_printf(ERR, "Could not write camera profiles\n");
-    TIFFClose(f_out);
-    free(image.buf);
-    free(preview.buf);
-    return ret;
-  }
+  for (i=0; i < NUM_PROFILES; i++)
+    if (!write_camera_profile(x3f, wb, &camera_profiles[i],
+			      i == 0 ? &ifd0 : &profile_ifd[i])) {
+      x3f_printf(ERR, "Could not write camera profiles\n");
+      ret = X3F_ARGUMENT_ERROR;
+      goto cleanup;
+    }
+  x3f_tiff_set_ascii(&ifd0, TIFFTAG_ASSHOTPROFILENAME, camera_profiles[0].name);
+  if (NUM_PROFILES > 1)
+    x3f_tiff_set_long(&ifd0, TIFFTAG_EXTRACAMERAPROFILES,
+		      NUM_PROFILES - 1, profile_offsets); /* Set below */
 
   if (!x3f_get_gain(x3f, wb, gain)) {
     x3f_printf(ERR, "Could not get gain for white balance: %s\n", wb);
-    TIFFClose(f_out);
-    free(image.buf);
-    free(preview.buf);
-    return X3F_ARGUMENT_ERROR;
+    ret = X3F_ARGUMENT_ERROR;
+    goto cleanup;
   }
   x3f_3x1_invert(gain, gain_inv);
-  vec_double_to_float(gain_inv, as_shot_neutral, 3);
-  TIFFSetField(f_out, TIFFTAG_ASSHOTNEUTRAL, 3, as_shot_neutral);
+  x3f_tiff_set_rational(&ifd0, TIFFTAG_ASSHOTNEUTRAL, 3, gain_inv);
 
 #define WB_D65 "Overcast"
   if (!x3f_get_gain(x3f, WB_D65, gain)) {
     x3f_printf(ERR, "Could not get gain for white balance: %s\n", WB_D65);
-    TIFFClose(f_out);
-    free(image.buf);
-    free(preview.buf);
-    return X3F_ARGUMENT_ERROR;
+    ret = X3F_ARGUMENT_ERROR;
+    goto cleanup;
   }
   x3f_3x1_invert(gain, gain_inv);
   x3f_3x3_diag(gain_inv, gain_inv_mat);
-  vec_double_to_float(gain_inv_mat, camera_calibration1, 9);
-  TIFFSetField(f_out, TIFFTAG_CAMERACALIBRATION1, 9, camera_calibration1);
-
-  for (row=0; row < preview.rows; row++)
-    TIFFWriteScanline(f_out, preview.data + preview.row_stride*row, row, 0);
-
-  TIFFWriteDirectory(f_out);
-
-  TIFFSetField(f_out, TIFFTAG_SUBFILETYPE, 0);
-  TIFFSetField(f_out, TIFFTAG_IMAGEWIDTH, image.columns);
-  TIFFSetField(f_out, TIFFTAG_IMAGELENGTH, image.rows);
-  TIFFSetField(f_out, TIFFTAG_ROWSPERSTRIP, 32);
-  TIFFSetField(f_out, TIFFTAG_SAMPLESPERPIXEL, 3);
-  TIFFSetField(f_out, TIFFTAG_BITSPERSAMPLE, 16);
-  TIFFSetField(f_out, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
-  TIFFSetField(f_out, TIFFTAG_COMPRESSION,
-	       compress ? COMPRESSION_ADOBE_DEFLATE : COMPRESSION_NONE);
-  TIFFSetField(f_out, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_LINEARRAW);
+  x3f_tiff_set_srational(&ifd0, TIFFTAG_CAMERACALIBRATION1, 9, gain_inv_mat);
+
+  /* END - IFD0 */
+
+  /* BEGIN - SubIFD, i.e. the LinearRaw image */
+
+  /* With bits == 0, store exactly as many bits as the intermediate
+     levels need, which is lossless. Storing fewer bits than that
+     requires a LinearizationTable; BlackLevel and WhiteLevel still
+     refer to the linearized values. */
+  max_white = ilevels.white[0];
+  for (i=1; i < 3; i++)
+    if (ilevels.white[i] > max_white) max_white = ilevels.white[i];
+  if (bits == 0) bits = bits_needed(max_white);
+
+  if (bits < bits_needed(max_white)) {
+    table = malloc(sizeof(uint16_t) << bits);
+    encode = malloc(sizeof(uint16_t)*65536);
+    make_linearization(max_white, bits, table, encode);
+    x3f_tiff_set_short(&sub_ifd, TIFFTAG_LINEARIZATIONTABLE, 1 << bits, table);
+  }
+  x3f_printf(DEBUG, "DNG raw data: %d bits%s\n", bits,
+	     table ? " with linearization table" : "");
+
+  for (i=0; i < 3; i++) bits_image[i] = bits;
+
+  num_strips = (image.rows + ROWS_PER_STRIP - 1)/ROWS_PER_STRIP;
+  strips = calloc(num_strips, sizeof(dng_strip_t));
+  strip_offsets = calloc(num_strips, sizeof(uint32_t));
+  strip_sizes = calloc(num_strips, sizeof(uint32_t));
+
+  job.image = &image;
+  job.bits = bits;
+  job.encode = encode;
+  job.compress = compress;
+  job.first = 0;
+  job.strips = strips;
+  job.error = 0;
+
+  if (compress) {
+    /* The compressed sizes are needed for the layout */
+    if (!encode_strips(&job, 0, num_strips)) {
+      ret = X3F_INTERNAL_ERROR;
+      goto cleanup;
+    }
+    for (i=0; i < num_strips; i++)
+      strip_sizes[i] = strips[i].size;
+  }
+  else
+    for (i=0; i < num_strips; i++)
+      strip_sizes[i] = strip_rows(&image, i)*row_bytes(&image, bits);
+
+  x3f_tiff_set_long1(&sub_ifd, TIFFTAG_SUBFILETYPE, 0);
+  x3f_tiff_set_long1(&sub_ifd, TIFFTAG_IMAGEWIDTH, image.columns);
+  x3f_tiff_set_long1(&sub_ifd, TIFFTAG_IMAGELENGTH, image.rows);
+  x3f_tiff_set_short(&sub_ifd, TIFFTAG_BITSPERSAMPLE, 3, bits_image);
+  x3f_tiff_set_short1(&sub_ifd, TIFFTAG_COMPRESSION,
+		      compress ? COMPRESSION_ADOBE_DEFLATE : COMPRESSION_NONE);
+  x3f_tiff_set_short1(&sub_ifd, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_LINEARRAW);
+  x3f_tiff_set_long(&sub_ifd, TIFFTAG_STRIPOFFSETS,
+		    num_strips, strip_offsets); /* Set below */
+  x3f_tiff_set_short1(&sub_ifd, TIFFTAG_SAMPLESPERPIXEL, 3);
+  x3f_tiff_set_long1(&sub_ifd, TIFFTAG_ROWSPERSTRIP, ROWS_PER_STRIP);
+  x3f_tiff_set_long(&sub_ifd, TIFFTAG_STRIPBYTECOUNTS, num_strips, strip_sizes);
+  x3f_tiff_set_short1(&sub_ifd, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
   /* Prevent further chroma denoising in DNG processing software */
-  TIFFSetField(f_out, TIFFTAG_CHROMABLURRADIUS, 0.0);
+  x3f_tiff_set_rational(&sub_ifd, TIFFTAG_CHROMABLURRADIUS,
+			1, &chroma_blur_radius);
 
-  vec_double_to_float(ilevels.black, black_level, 3);
-  TIFFSetField(f_out, TIFFTAG_BLACKLEVEL, 3, black_level);
-  TIFFSetField(f_out, TIFFTAG_WHITELEVEL, 3, ilevels.white);
+  for (i=0; i < 3; i++) black_level[i] = ilevels.black[i];
+  x3f_tiff_set_rational(&sub_ifd, TIFFTAG_BLACKLEVEL, 3, black_level);
+  x3f_tiff_set_long(&sub_ifd, TIFFTAG_WHITELEVEL, 3, ilevels.white);
 
   if (apply_sgain)
-    if (!write_spatial_gain(x3f, &image, wb, f_out))
+    if (!write_spatial_gain(x3f, &image, wb, &sub_ifd))
       x3f_printf(WARN, "Could not get spatial gain\n");
 
   if (get_camf_rect_as_dngrect(x3f, "ActiveImageArea", &image, 1, active_area))
-    TIFFSetField(f_out, TIFFTAG_ACTIVEAREA, active_area);
+    x3f_tiff_set_long(&sub_ifd, TIFFTAG_ACTIVEAREA, 4, active_area);
+
+  /* END - SubIFD */
+
+  /* BEGIN - layout. Only the sizes of the IFDs matter here, so the
+     offsets set to zero above can be patched afterwards. */
+
+  offset = X3F_TIFF_HEADER_SIZE + x3f_tiff_ifd_size(&ifd0);
+  sub_ifd_offset = offset;
+  offset += x3f_tiff_ifd_size(&sub_ifd);
+  for (i=1; i < NUM_PROFILES; i++) {
+    profile_offsets[i-1] = offset;
+    offset += profile_block_size(&profile_ifd[i]);
+  }
+  head_size = offset;
 
-  for (row=0; row < image.rows; row++)
-    TIFFWriteScanline(f_out, image.data + image.row_stride*row, row, 0);
+  preview_offset = offset;
+  offset += (preview_size + 1) & ~1;
+
+  for (i=0; i < num_strips; i++) {
+    strip_offsets[i] = offset;
+    offset += (strip_sizes[i] + 1) & ~1;
+  }
 
-  TIFFWriteDirectory(f_out);
-  TIFFClose(f_out);
+  x3f_tiff_set_long1(&ifd0, TIFFTAG_STRIPOFFSETS, preview_offset);
+  x3f_tiff_set_long1(&ifd0, TIFFTAG_SUBIFD, sub_ifd_offset);
+  if (NUM_PROFILES > 1)
+    x3f_tiff_set_long(&ifd0, TIFFTAG_EXTRACAMERAPROFILES,
+		      NUM_PROFILES - 1, profile_offsets);
+  x3f_tiff_set_long(&sub_ifd, TIFFTAG_STRIPOFFSETS,
+		    num_strips, strip_offsets);
+
+  /* END - layout */
+
+  /* BEGIN - writing, strictly sequentially */
+
+  head = malloc(head_size);
+  x3f_tiff_header_write(head, 42, X3F_TIFF_HEADER_SIZE, 0);
+  x3f_tiff_ifd_write(&ifd0, head + X3F_TIFF_HEADER_SIZE,
+		     X3F_TIFF_HEADER_SIZE, 0, 0);
+  x3f_tiff_ifd_write(&sub_ifd, head + sub_ifd_offset, sub_ifd_offset, 0, 0);
+  for (i=1; i < NUM_PROFILES; i++)
+    profile_block_write(&profile_ifd[i], head + profile_offsets[i-1]);
+
+  if (!write_all(f_out, head, head_size)) goto write_error;
+
+  for (row=0; row < preview.rows; row++)
+    if (!write_all(f_out, preview.data + preview.row_stride*row,
+		   preview.columns*preview.channels))
+      goto write_error;
+  if (preview_size & 1 && !write_all(f_out, "", 1)) goto write_error;
+
+  /* Uncompressed strips are encoded a batch at a time, to bound the
+     memory use while still keeping all threads busy */
+  batch = compress ? num_strips : 4*x3f_get_num_threads();
+  for (i=0; i < num_strips; i++) {
+    int first = i - i % batch;
+
+    if (!compress && i == first) {
+      if (first > 0) free_strips(strips, first - batch, batch);
+      encode_strips(&job, first,
+		    first + batch < num_strips ? batch : num_strips - first);
+    }
+    if (!write_all(f_out, strips[i].data, strip_sizes[i])) goto write_error;
+    if (strip_sizes[i] & 1 && !write_all(f_out, "", 1)) goto write_error;
+  }
+
+  if (fflush(f_out) == 0) goto cleanup;
+
+  /* END - writing */
+
+ write_error:
+  x3f_printf(ERR, "Could not write DNG data\n");
+  ret = X3F_OUTFILE_ERROR;
+
+ cleanup:
+  x3f_tiff_ifd_cleanup(&ifd0);
+  x3f_tiff_ifd_cleanup(&sub_ifd);
+  for (i=0; i < NUM_PROFILES; i++)
+    x3f_tiff_ifd_cleanup(&profile_ifd[i]);
+  if (strips) free_strips(strips, 0, num_strips);
+  free(strips);
+  free(strip_offsets);
+  free(strip_sizes);
+  free(head);
+  free(table);
+  free(encode);
   free(image.buf);
   free(preview.buf);
 
-  return X3F_OK;
+  return ret;
+}
+
+#if defined(_WIN32) || defined(_WIN64)
+#define BINMODE O_BINARY
+#else
+#define BINMODE 0
+#endif
+
+/* extern */
+x3f_return_t x3f_dump_raw_data_as_dng(x3f_t *x3f,
+				      char *outfilename,
+				      int denoise,
+				      int apply_sgain,
+				      char *wb,
+				      int compress,
+				      int bits,
+				      int rotation)
+{
+  x3f_return_t ret;
+  int fd = open(outfilename, O_WRONLY | BINMODE | O_CREAT | O_TRUNC, 0444);
+  FILE *f_out;
+
+  if (fd == -1) return X3F_OUTFILE_ERROR;
+  if (!(f_out = fdopen(fd, "wb"))) {
+    close(fd);
+    return X3F_OUTFILE_ERROR;
+  }
+
+  ret = x3f_dump_raw_data_as_dng_stream(x3f, f_out,
+					denoise, apply_sgain, wb, compress, bits,
+					rotation);
+
+  if (fclose(f_out) != 0 && ret == X3F_OK) ret = X3F_OUTFILE_ERROR;
+
+  return ret;
 }
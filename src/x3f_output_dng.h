@@ -12,10 +12,26 @@
 
 #include "x3f_io.h"
 
+#include <stdio.h>
+
 extern x3f_return_t x3f_dump_raw_data_as_dng(x3f_t *x3f, char *outfilename,
 					     int denoise,
 					     int apply_sgain,
 					     char *wb,
-					     int compress);
+					     int compress,
+					     int bits,
+					     int rotation);
+
+/* Writes the DNG strictly sequentially, i.e. f_out may be a pipe.
+   bits is the sample size of the raw data, 8 ... 16, or 0 for the
+   smallest size that is still lossless. rotation, in degrees
+   clockwise, only sets the Orientation tag. */
+extern x3f_return_t x3f_dump_raw_data_as_dng_stream(x3f_t *x3f, FILE *f_out,
+						    int denoise,
+						    int apply_sgain,
+						    char *wb,
+						    int compress,
+						    int bits,
+						    int rotation);
 
 #endif
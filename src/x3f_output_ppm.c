@@ -9,6 +9,7 @@
 
 #include "x3f_output_ppm.h"
 #include "x3f_process.h"
+#include "x3f_rotate.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -29,9 +30,11 @@ x3f_return_t x3f_dump_raw_data_as_ppm(x3f_t *x3f,
 				      int denoise,
 				      int apply_sgain,
 				      char *wb,
-				      int binary)
+				      int binary,
+				      int rotation)
 {
   x3f_area16_t image;
+  x3f_rotation_t rot;
   FILE *f_out = fopen(outfilename, "wb");
   int row;
 
@@ -45,19 +48,26 @@ x3f_return_t x3f_dump_raw_data_as_ppm(x3f_t *x3f,
     return X3F_ARGUMENT_ERROR;
   }
 
+  if (!x3f_rotation_init(&rot, &image, rotation)) {
+    fclose(f_out);
+    free(image.buf);
+    return X3F_ARGUMENT_ERROR;
+  }
+
   if (binary)
-    fprintf(f_out, "P6\n%d %d\n65535\n", image.columns, image.rows);
+    fprintf(f_out, "P6\n%d %d\n65535\n", rot.columns, rot.rows);
   else
-    fprintf(f_out, "P3\n%d %d\n65535\n", image.columns, image.rows);
+    fprintf(f_out, "P3\n%d %d\n65535\n", rot.columns, rot.rows);
 
-  for (row=0; row < image.rows; row++) {
+  for (row=0; row < rot.rows; row++) {
+    uint16_t *data = x3f_rotated_row(&rot, row);
     int col;
 
-    for (col=0; col < image.columns; col++) {
+    for (col=0; col < rot.columns; col++) {
       int color;
 
       for (color=0; color < 3; color++) {
-	uint16_t val = image.data[image.row_stride*row + image.channels*col + color];
+	uint16_t val = data[image.channels*col + color];
 	if (binary)
 	  write_16B(f_out, val);
 	else
@@ -69,6 +79,7 @@ x3f_return_t x3f_dump_raw_data_as_ppm(x3f_t *x3f,
   }
 
   fclose(f_out);
+  x3f_rotation_cleanup(&rot);
   free(image.buf);
 
   return X3F_OK;
@@ -19,6 +19,7 @@ extern x3f_return_t x3f_dump_raw_data_as_ppm(x3f_t *x3f, char *outfilename,
 					     int denoise,
 					     int apply_sgain,
 					     char *wb,
-                                             int binary);
+                                             int binary,
+					     int rotation);
 
 #endif
@@ -9,6 +9,7 @@
 
 #include "x3f_output_tiff.h"
 #include "x3f_process.h"
+#include "x3f_rotate.h"
 
 #include <stdlib.h>
 #include <tiffio.h>
@@ -21,9 +22,11 @@ x3f_return_t x3f_dump_raw_data_as_tiff(x3f_t *x3f,
 				       int denoise,
 				       int apply_sgain,
 				       char *wb,
-				       int compress)
+				       int compress,
+				       int rotation)
 {
   x3f_area16_t image;
+  x3f_rotation_t rot;
   TIFF *f_out = TIFFOpen(outfilename, "w");
   int row;
 
@@ -36,8 +39,14 @@ x3f_return_t x3f_dump_raw_data_as_tiff(x3f_t *x3f,
     return X3F_ARGUMENT_ERROR;
   }
 
-  TIFFSetField(f_out, TIFFTAG_IMAGEWIDTH, image.columns);
-  TIFFSetField(f_out, TIFFTAG_IMAGELENGTH, image.rows);
+  if (!x3f_rotation_init(&rot, &image, rotation)) {
+    TIFFClose(f_out);
+    free(image.buf);
+    return X3F_ARGUMENT_ERROR;
+  }
+
+  TIFFSetField(f_out, TIFFTAG_IMAGEWIDTH, rot.columns);
+  TIFFSetField(f_out, TIFFTAG_IMAGELENGTH, rot.rows);
   TIFFSetField(f_out, TIFFTAG_ROWSPERSTRIP, 32);
   TIFFSetField(f_out, TIFFTAG_SAMPLESPERPIXEL, image.channels);
   TIFFSetField(f_out, TIFFTAG_BITSPERSAMPLE, 16);
@@ -51,11 +60,12 @@ x3f_return_t x3f_dump_raw_data_as_tiff(x3f_t *x3f,
   TIFFSetField(f_out, TIFFTAG_YRESOLUTION, 72.0);
   TIFFSetField(f_out, TIFFTAG_RESOLUTIONUNIT, RESUNIT_INCH);
 
-  for (row=0; row < image.rows; row++)
-    TIFFWriteScanline(f_out, image.data + image.row_stride*row, row, 0);
+  for (row=0; row < rot.rows; row++)
+    TIFFWriteScanline(f_out, x3f_rotated_row(&rot, row), row, 0);
 
   TIFFWriteDirectory(f_out);
   TIFFClose(f_out);
+  x3f_rotation_cleanup(&rot);
   free(image.buf);
 
   return X3F_OK;
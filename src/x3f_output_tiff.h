@@ -19,6 +19,7 @@ extern x3f_return_t x3f_dump_raw_data_as_tiff(x3f_t *x3f, char *outfilename,
 					      int denoise,
 					      int apply_sgain,
 					      char *wb,
-					      int compress);
+					      int compress,
+					      int rotation);
 
 #endif
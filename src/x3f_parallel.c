@@ -0,0 +1,188 @@
+/* X3F_PARALLEL.C
+ *
+ * Library for running independent pieces of work on several threads,
+ * either as a parallel loop or as tasks on a shared pool.
+ *
+ * Copyright 2016 - Roland and Erik Karlsson
+ * BSD-style - see doc/copyright.txt
+ *
+ */
+
+#include "x3f_parallel.h"
+#include "x3f_printf.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#define MAX_THREADS 64
+
+static int num_threads = 0;
+
+static int get_num_cpus(void)
+{
+#if defined(_WIN32) || defined(_WIN64)
+  SYSTEM_INFO info;
+
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors;
+#else
+  long num = sysconf(_SC_NPROCESSORS_ONLN);
+
+  return num > 0 ? num : 1;
+#endif
+}
+
+/* extern */ void x3f_set_num_threads(int num)
+{
+  num_threads = num < 0 ? 0 : num;
+}
+
+/* extern */ int x3f_get_num_threads(void)
+{
+  int num = num_threads ? num_threads : get_num_cpus();
+
+  return num > MAX_THREADS ? MAX_THREADS : num;
+}
+
+typedef struct {
+  x3f_parallel_fn_t fn;
+  void *arg;
+  int num;
+  int next;			/* Next index to hand out */
+} parallel_job_t;
+
+static void *parallel_worker(void *p)
+{
+  parallel_job_t *job = (parallel_job_t *)p;
+  int index;
+
+  while ((index = __sync_fetch_and_add(&job->next, 1)) < job->num)
+    job->fn(job->arg, index);
+
+  return NULL;
+}
+
+/* The shared pool. Workers are never stopped, they wait for more
+   tasks for as long as the process lives. */
+
+typedef struct pool_task_s {
+  x3f_task_fn_t fn;
+  void *arg;
+  struct pool_task_s *next;
+} pool_task_t;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static pool_task_t *pool_head = NULL, *pool_tail = NULL;
+static int pool_workers = 0;
+
+/* Set on the pool workers. All of them may be running tasks at once,
+   so a parallel loop within a task runs on the worker itself instead
+   of starting threads of its own. */
+static pthread_once_t worker_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t worker_key;
+
+static void make_worker_key(void)
+{
+  pthread_key_create(&worker_key, NULL);
+}
+
+static int on_pool_worker(void)
+{
+  pthread_once(&worker_key_once, make_worker_key);
+  return pthread_getspecific(worker_key) != NULL;
+}
+
+static void *pool_worker(void *p)
+{
+  pthread_once(&worker_key_once, make_worker_key);
+  pthread_setspecific(worker_key, &worker_key);
+
+  for (;;) {
+    pool_task_t *task;
+
+    pthread_mutex_lock(&pool_lock);
+    while (!pool_head)
+      pthread_cond_wait(&pool_cond, &pool_lock);
+    task = pool_head;
+    pool_head = task->next;
+    if (!pool_head) pool_tail = NULL;
+    pthread_mutex_unlock(&pool_lock);
+
+    task->fn(task->arg);
+    free(task);
+  }
+
+  return NULL;
+}
+
+/* Called with pool_lock held */
+static int start_pool(void)
+{
+  int num = x3f_get_num_threads();
+
+  while (pool_workers < num) {
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, pool_worker, NULL)) break;
+    pthread_detach(thread);
+    pool_workers++;
+  }
+
+  x3f_printf(DEBUG, "Started pool with %d workers\n", pool_workers);
+
+  return pool_workers > 0;
+}
+
+/* extern */ int x3f_pool_submit(x3f_task_fn_t fn, void *arg)
+{
+  pool_task_t *task = malloc(sizeof(pool_task_t));
+
+  if (!task) return 0;
+  task->fn = fn;
+  task->arg = arg;
+  task->next = NULL;
+
+  pthread_mutex_lock(&pool_lock);
+  if (pool_workers == 0 && !start_pool()) {
+    pthread_mutex_unlock(&pool_lock);
+    free(task);
+    return 0;
+  }
+  if (pool_tail) pool_tail->next = task;
+  else pool_head = task;
+  pool_tail = task;
+  pthread_cond_signal(&pool_cond);
+  pthread_mutex_unlock(&pool_lock);
+
+  return 1;
+}
+
+/* extern */ void x3f_parallel_for(int num, x3f_parallel_fn_t fn, void *arg)
+{
+  parallel_job_t job = {fn, arg, num, 0};
+  pthread_t thread[MAX_THREADS];
+  int threads = on_pool_worker() ? 1 : x3f_get_num_threads();
+  int started, i;
+
+  if (threads > num) threads = num;
+
+  /* The calling thread takes part in the work too */
+  for (started=0; started < threads - 1; started++)
+    if (pthread_create(&thread[started], NULL, parallel_worker, &job)) {
+      x3f_printf(DEBUG, "Could not create thread, continuing with %d\n",
+		 started + 1);
+      break;
+    }
+
+  parallel_worker(&job);
+
+  for (i=0; i < started; i++)
+    pthread_join(thread[i], NULL);
+}
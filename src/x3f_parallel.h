@@ -0,0 +1,41 @@
+/* X3F_PARALLEL.H
+ *
+ * Library for running independent pieces of work on several threads,
+ * either as a parallel loop or as tasks on a shared pool.
+ *
+ * Copyright 2016 - Roland and Erik Karlsson
+ * BSD-style - see doc/copyright.txt
+ *
+ */
+
+#ifndef X3F_PARALLEL_H
+#define X3F_PARALLEL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef void (*x3f_parallel_fn_t)(void *arg, int index);
+
+/* Call fn(arg, index) for all index in [0, num), spread over the
+   available threads. Returns when all calls are done. The order of
+   the calls is undefined. Within a task on the shared pool, all calls
+   are made on the calling thread. */
+extern void x3f_parallel_for(int num, x3f_parallel_fn_t fn, void *arg);
+
+typedef void (*x3f_task_fn_t)(void *arg);
+
+/* Queue fn(arg) on the shared pool of worker threads and return at
+   once. The pool is started on first use, with as many workers as
+   x3f_get_num_threads() says at that time. Returns 0 on failure. */
+extern int x3f_pool_submit(x3f_task_fn_t fn, void *arg);
+
+/* 0 means one thread per online CPU */
+extern void x3f_set_num_threads(int num);
+extern int x3f_get_num_threads(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
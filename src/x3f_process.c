@@ -467,16 +467,21 @@ static void interpolate_bad_pixels(x3f_t *x3f, x3f_area16_t *image, int colors)
   free(bad_pixel_vec);
 }
 
-static int preprocess_data(x3f_t *x3f, char *wb, x3f_image_levels_t *ilevels)
+/* Preprocesses image, and for Quattro also qtop, in place. Both must
+   be private copies of the decoded data. */
+static int preprocess_data(x3f_t *x3f, char *wb,
+			   x3f_area16_t *image_in, x3f_area16_t *qtop_in,
+			   x3f_image_levels_t *ilevels)
 {
-  x3f_area16_t image, qtop;
+  x3f_area16_t image = *image_in, qtop;
   int row, col, color;
   uint32_t max_raw[3];
   double scale[3], black_level[3], black_dev[3], intermediate_bias;
-  int quattro = x3f_image_area_qtop(x3f, &qtop);
+  int quattro = qtop_in != NULL;
   int colors_in = quattro ? 2 : 3;
 
-  if (!x3f_image_area(x3f, &image) || image.channels < 3) return 0;
+  if (image.channels < 3) return 0;
+  if (quattro) qtop = *qtop_in;
   if (quattro && (qtop.channels < 1 ||
 		  qtop.rows < 2*image.rows || qtop.columns < 2*image.columns))
     return 0;
@@ -697,15 +702,14 @@ static int convert_data(x3f_t *x3f,
   return 1;
 }
 
-static int run_denoising(x3f_t *x3f)
+static int run_denoising(x3f_t *x3f, x3f_area16_t *original_image)
 {
-  x3f_area16_t original_image, image;
+  x3f_area16_t image;
   x3f_denoise_type_t type = X3F_DENOISE_STD;
   char *sensorid;
 
-  if (!x3f_image_area(x3f, &original_image)) return 0;
-  if (!x3f_crop_area_camf(x3f, "ActiveImageArea", &original_image, 1, &image)) {
-    image = original_image;
+  if (!x3f_crop_area_camf(x3f, "ActiveImageArea", original_image, 1, &image)) {
+    image = *original_image;
     x3f_printf(WARN, "Could not get active area, denoising entire image\n");
   }
 
@@ -717,24 +721,25 @@ static int run_denoising(x3f_t *x3f)
   return 1;
 }
 
-static int expand_quattro(x3f_t *x3f, int denoise, x3f_area16_t *expanded)
+/* NOTE: destroys the data of image, which thus must be a private copy */
+static int expand_quattro(x3f_t *x3f, int denoise,
+			  x3f_area16_t *image, x3f_area16_t *qtop,
+			  x3f_area16_t *expanded)
 {
-  x3f_area16_t image, active, qtop, qtop_crop, active_exp;
+  x3f_area16_t active, qtop_crop, active_exp;
   uint32_t rect[4];
 
-  if (!x3f_image_area_qtop(x3f, &qtop)) return 0;
-  if (!x3f_image_area(x3f, &image)) return 0;
   if (denoise &&
-      !x3f_crop_area_camf(x3f, "ActiveImageArea", &image, 1, &active)) {
-    active = image;
+      !x3f_crop_area_camf(x3f, "ActiveImageArea", image, 1, &active)) {
+    active = *image;
     x3f_printf(WARN, "Could not get active area, denoising entire image\n");
   }
 
   rect[0] = 0;
   rect[1] = 0;
-  rect[2] = 2*image.columns - 1;
-  rect[3] = 2*image.rows - 1;
-  if (!x3f_crop_area(rect, &qtop, &qtop_crop)) return 0;
+  rect[2] = 2*image->columns - 1;
+  rect[3] = 2*image->rows - 1;
+  if (!x3f_crop_area(rect, qtop, &qtop_crop)) return 0;
 
   expanded->columns = qtop_crop.columns;
   expanded->rows = qtop_crop.rows;
@@ -749,7 +754,7 @@ static int expand_quattro(x3f_t *x3f, int denoise, x3f_area16_t *expanded)
     x3f_printf(WARN, "Could not get active area, denoising entire image\n");
   }
 
-  x3f_expand_quattro(&image, denoise ? &active : NULL, &qtop_crop,
+  x3f_expand_quattro(image, denoise ? &active : NULL, &qtop_crop,
 		     expanded, denoise ? &active_exp : NULL);
 
   return 1;
@@ -764,14 +769,13 @@ static int expand_quattro(x3f_t *x3f, int denoise, x3f_area16_t *expanded)
 			       int apply_sgain,
 			       char *wb)
 {
-  x3f_area16_t original_image, expanded;
+  x3f_area16_t original_image, qtop, work, work_qtop, expanded;
   x3f_image_levels_t il;
+  int quattro;
 
   if (wb == NULL) wb = x3f_get_wb(x3f);
 
   if (encoding == QTOP) {
-    x3f_area16_t qtop;
-
     if (!x3f_image_area_qtop(x3f, &qtop)) return 0;
     if (!crop || !x3f_crop_area_camf(x3f, "ActiveImageArea", &qtop, 0, image))
       *image = qtop;
@@ -780,29 +784,54 @@ static int expand_quattro(x3f_t *x3f, int denoise, x3f_area16_t *expanded)
   }
 
   if (!x3f_image_area(x3f, &original_image)) return 0;
-  if (!crop || !x3f_crop_area_camf(x3f, "ActiveImageArea", &original_image, 1,
-				   image))
-    *image = original_image;
 
-  if (encoding == UNPROCESSED) return ilevels == NULL;
+  if (encoding == UNPROCESSED) {
+    if (!crop || !x3f_crop_area_camf(x3f, "ActiveImageArea", &original_image,
+				     1, image))
+      *image = original_image;
 
-  if (!preprocess_data(x3f, wb, &il)) return 0;
+    return ilevels == NULL;
+  }
 
-  if (expand_quattro(x3f, denoise, &expanded)) {
-    /* NOTE: expand_quattro destroys the data of original_image */
-    if (!crop ||
-	!x3f_crop_area_camf(x3f, "ActiveImageArea", &expanded, 0, image))
-      *image = expanded;
-    original_image = expanded;
+  /* The decoded data may be shared by concurrent renders, so it is
+     never modified. All processing is done on private copies. */
+  quattro = x3f_image_area_qtop(x3f, &qtop);
+  if (!x3f_copy_area(&original_image, &work)) return 0;
+  if (quattro && !x3f_copy_area(&qtop, &work_qtop)) {
+    free(work.buf);
+    return 0;
+  }
+
+  if (!preprocess_data(x3f, wb, &work, quattro ? &work_qtop : NULL, &il)) {
+    free(work.buf);
+    if (quattro) free(work_qtop.buf);
+    return 0;
+  }
+
+  if (quattro) {
+    int expanded_ok = expand_quattro(x3f, denoise, &work, &work_qtop,
+				     &expanded);
+
+    free(work.buf);
+    free(work_qtop.buf);
+    if (!expanded_ok) return 0;
+    work = expanded;
+  }
+  else if (denoise && !run_denoising(x3f, &work)) {
+    free(work.buf);
+    return 0;
   }
-  else if (denoise && !run_denoising(x3f)) return 0;
 
   if (encoding != NONE &&
-      !convert_data(x3f, &original_image, &il, encoding, apply_sgain, wb)) {
-    free(image->buf);
+      !convert_data(x3f, &work, &il, encoding, apply_sgain, wb)) {
+    free(work.buf);
     return 0;
   }
 
+  if (!crop || !x3f_crop_area_camf(x3f, "ActiveImageArea", &work, !quattro,
+				   image))
+    *image = work;
+
   if (ilevels) *ilevels = il;
   return 1;
 }
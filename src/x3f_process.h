@@ -30,6 +30,10 @@ extern int x3f_get_gain(x3f_t *x3f, char *wb, double *gain);
 extern int x3f_get_bmt_to_xyz(x3f_t *x3f, char *wb, double *bmt_to_xyz);
 extern int x3f_get_raw_to_xyz(x3f_t *x3f, char *wb, double *raw_to_xyz);
 
+/* The decoded data in x3f is left untouched. For UNPROCESSED and QTOP,
+   image refers directly to it and must be treated as read-only, with
+   image->buf set to NULL. Otherwise image is a buffer of its own that
+   the caller has to free() via image->buf. */
 extern int x3f_get_image(x3f_t *x3f,
 			 x3f_area16_t *image,
 			 x3f_image_levels_t *ilevels,
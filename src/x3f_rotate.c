@@ -0,0 +1,146 @@
+/* X3F_ROTATE.C
+ *
+ * Library for physically rotating image data while it is written.
+ *
+ * Copyright 2016 - Roland and Erik Karlsson
+ * BSD-style - see doc/copyright.txt
+ *
+ */
+
+#include "x3f_rotate.h"
+#include "x3f_parallel.h"
+#include "x3f_printf.h"
+
+#include <stdlib.h>
+#include <stddef.h>
+
+/* A tile of 64x64 pixels with 3x16 bit samples is 24 kB, so both the
+   source rows and the destination rows of a tile stay in L1 cache
+   while it is transposed */
+#define TILE 64
+#define STRIP_ROWS (4*TILE)
+
+typedef struct {
+  x3f_rotation_t *rot;
+  uint32_t row0, rows;		/* Rotated rows in this strip */
+  uint32_t tiles_x;
+} rotate_job_t;
+
+static void rotate_tile(void *arg, int index)
+{
+  rotate_job_t *job = (rotate_job_t *)arg;
+  x3f_rotation_t *rot = job->rot;
+  x3f_area16_t *image = rot->image;
+  uint32_t ch = image->channels;
+  uint32_t stride = rot->columns*ch;
+  uint32_t r0 = (index / job->tiles_x)*TILE;
+  uint32_t c0 = (index % job->tiles_x)*TILE;
+  uint32_t r1 = r0 + TILE < job->rows ? r0 + TILE : job->rows;
+  uint32_t c1 = c0 + TILE < rot->columns ? c0 + TILE : rot->columns;
+  uint32_t row0 = job->row0;
+  uint32_t r, c, k;
+
+  if (rot->rotation == 180) {
+    for (r=r0; r < r1; r++) {
+      const uint16_t *src = image->data +
+	image->row_stride*(image->rows - 1 - (row0 + r)) +
+	ch*(image->columns - 1 - c0);
+      uint16_t *dst = rot->strip + stride*r + ch*c0;
+
+      for (c=c0; c < c1; c++, src -= ch, dst += ch)
+	for (k=0; k < ch; k++) dst[k] = src[k];
+    }
+    return;
+  }
+
+  /* 90 and 270: each destination column is a source row. Looping over
+     the destination columns on the outside reads the source
+     sequentially, while the strided writes stay within the tile. */
+  for (c=c0; c < c1; c++) {
+    const uint16_t *src;
+    ptrdiff_t step;
+    uint16_t *dst = rot->strip + stride*r0 + ch*c;
+
+    if (rot->rotation == 90) {
+      src = image->data + image->row_stride*(image->rows - 1 - c) +
+	ch*(row0 + r0);
+      step = ch;
+    }
+    else {
+      src = image->data + image->row_stride*c +
+	ch*(image->columns - 1 - (row0 + r0));
+      step = -(ptrdiff_t)ch;
+    }
+
+    for (r=r0; r < r1; r++, src += step, dst += stride)
+      for (k=0; k < ch; k++) dst[k] = src[k];
+  }
+}
+
+static void fill_strip(x3f_rotation_t *rot, uint32_t row0)
+{
+  rotate_job_t job;
+  uint32_t tiles_y;
+
+  job.rot = rot;
+  job.row0 = row0;
+  job.rows = rot->rows - row0 < STRIP_ROWS ? rot->rows - row0 : STRIP_ROWS;
+  job.tiles_x = (rot->columns + TILE - 1)/TILE;
+  tiles_y = (job.rows + TILE - 1)/TILE;
+
+  x3f_parallel_for(job.tiles_x*tiles_y, rotate_tile, &job);
+
+  rot->strip_row0 = row0;
+  rot->strip_rows = job.rows;
+}
+
+/* extern */ int x3f_rotation_init(x3f_rotation_t *rot, x3f_area16_t *image,
+				   int rotation)
+{
+  rot->image = image;
+  rot->rotation = rotation;
+  rot->strip = NULL;
+  rot->strip_row0 = 0;
+  rot->strip_rows = 0;
+
+  switch (rotation) {
+  case 0:
+  case 180:
+    rot->columns = image->columns;
+    rot->rows = image->rows;
+    break;
+  case 90:
+  case 270:
+    rot->columns = image->rows;
+    rot->rows = image->columns;
+    break;
+  default:
+    x3f_printf(ERR, "Unsupported rotation: %d\n", rotation);
+    return 0;
+  }
+
+  if (rotation != 0) {
+    rot->strip =
+      malloc(STRIP_ROWS*rot->columns*image->channels*sizeof(uint16_t));
+    if (!rot->strip) return 0;
+  }
+
+  return 1;
+}
+
+/* extern */ void x3f_rotation_cleanup(x3f_rotation_t *rot)
+{
+  free(rot->strip);
+  rot->strip = NULL;
+}
+
+/* extern */ uint16_t *x3f_rotated_row(x3f_rotation_t *rot, uint32_t row)
+{
+  if (rot->rotation == 0)
+    return rot->image->data + rot->image->row_stride*row;
+
+  if (row < rot->strip_row0 || row >= rot->strip_row0 + rot->strip_rows)
+    fill_strip(rot, row - row % STRIP_ROWS);
+
+  return rot->strip + rot->columns*rot->image->channels*(row - rot->strip_row0);
+}
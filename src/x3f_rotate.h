@@ -0,0 +1,37 @@
+/* X3F_ROTATE.H
+ *
+ * Library for physically rotating image data while it is written.
+ *
+ * Copyright 2016 - Roland and Erik Karlsson
+ * BSD-style - see doc/copyright.txt
+ *
+ */
+
+#ifndef X3F_ROTATE_H
+#define X3F_ROTATE_H
+
+#include "x3f_io.h"
+
+/* Rotated rows are produced one strip at a time, so the rotation is
+   done on the fly by the output stage instead of as a separate pass
+   over the entire image */
+typedef struct {
+  x3f_area16_t *image;
+  int rotation;			/* Clockwise, 0, 90, 180 or 270 degrees */
+  uint32_t columns, rows;	/* Size after rotation */
+  uint16_t *strip;		/* Rotated rows, compact */
+  uint32_t strip_row0, strip_rows;
+} x3f_rotation_t;
+
+/* rotation is in degrees clockwise, e.g. H->rotation. Returns 0 for
+   unsupported angles. */
+extern int x3f_rotation_init(x3f_rotation_t *rot, x3f_area16_t *image,
+			     int rotation);
+extern void x3f_rotation_cleanup(x3f_rotation_t *rot);
+
+/* Returns row of the rotated image, which has rot->columns pixels of
+   image->channels samples. The pointer is valid until the next
+   call. Rows should be fetched in increasing order. */
+extern uint16_t *x3f_rotated_row(x3f_rotation_t *rot, uint32_t row);
+
+#endif
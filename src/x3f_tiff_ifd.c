@@ -0,0 +1,306 @@
+/* X3F_TIFF_IFD.C
+ *
+ * Library for building TIFF image file directories in memory.
+ *
+ * Copyright 2016 - Roland and Erik Karlsson
+ * BSD-style - see doc/copyright.txt
+ *
+ */
+
+#include "x3f_tiff_ifd.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+
+#define ENTRY_SIZE 12
+
+static uint32_t type_size(uint16_t type)
+{
+  switch (type) {
+  case TIFF_BYTE:
+  case TIFF_ASCII:
+  case TIFF_SBYTE:
+  case TIFF_UNDEFINED:
+    return 1;
+  case TIFF_SHORT:
+  case TIFF_SSHORT:
+    return 2;
+  case TIFF_LONG:
+  case TIFF_SLONG:
+    return 4;
+  case TIFF_RATIONAL:
+  case TIFF_SRATIONAL:
+    return 8;
+  default:
+    assert(0);
+    return 0;
+  }
+}
+
+static uint32_t entry_data_size(x3f_tiff_entry_t *e)
+{
+  return e->count*type_size(e->type);
+}
+
+/* extern */ void x3f_tiff_ifd_init(x3f_tiff_ifd_t *ifd)
+{
+  ifd->num = 0;
+}
+
+/* extern */ void x3f_tiff_ifd_cleanup(x3f_tiff_ifd_t *ifd)
+{
+  int i;
+
+  for (i=0; i<ifd->num; i++)
+    free(ifd->entry[i].data);
+  ifd->num = 0;
+}
+
+/* Returns a new or recycled entry, keeping the entries sorted on tag
+   as required by the TIFF specification */
+static x3f_tiff_entry_t *get_entry(x3f_tiff_ifd_t *ifd, uint16_t tag)
+{
+  x3f_tiff_entry_t *e;
+  int i;
+
+  for (i=0; i<ifd->num && ifd->entry[i].tag < tag; i++);
+
+  if (i<ifd->num && ifd->entry[i].tag == tag) {
+    e = &ifd->entry[i];
+    free(e->data);
+  }
+  else {
+    assert(ifd->num < X3F_TIFF_MAX_ENTRIES);
+    memmove(&ifd->entry[i+1], &ifd->entry[i],
+	    (ifd->num - i)*sizeof(x3f_tiff_entry_t));
+    ifd->num++;
+    e = &ifd->entry[i];
+  }
+
+  e->tag = tag;
+  e->data = NULL;
+
+  return e;
+}
+
+static void set_entry(x3f_tiff_ifd_t *ifd, uint16_t tag, uint16_t type,
+		      uint32_t count, const void *val)
+{
+  x3f_tiff_entry_t *e = get_entry(ifd, tag);
+
+  e->type = type;
+  e->count = count;
+  e->data = malloc(entry_data_size(e));
+  memcpy(e->data, val, entry_data_size(e));
+}
+
+/* extern */ void x3f_tiff_set_byte(x3f_tiff_ifd_t *ifd, uint16_t tag,
+				    uint32_t count, const uint8_t *val)
+{
+  set_entry(ifd, tag, TIFF_BYTE, count, val);
+}
+
+/* extern */ void x3f_tiff_set_ascii(x3f_tiff_ifd_t *ifd, uint16_t tag,
+				     const char *val)
+{
+  /* The count includes the terminating NUL */
+  set_entry(ifd, tag, TIFF_ASCII, strlen(val) + 1, val);
+}
+
+/* extern */ void x3f_tiff_set_short(x3f_tiff_ifd_t *ifd, uint16_t tag,
+				     uint32_t count, const uint16_t *val)
+{
+  set_entry(ifd, tag, TIFF_SHORT, count, val);
+}
+
+/* extern */ void x3f_tiff_set_long(x3f_tiff_ifd_t *ifd, uint16_t tag,
+				    uint32_t count, const uint32_t *val)
+{
+  set_entry(ifd, tag, TIFF_LONG, count, val);
+}
+
+/* extern */ void x3f_tiff_set_short1(x3f_tiff_ifd_t *ifd, uint16_t tag,
+				      uint16_t val)
+{
+  x3f_tiff_set_short(ifd, tag, 1, &val);
+}
+
+/* extern */ void x3f_tiff_set_long1(x3f_tiff_ifd_t *ifd, uint16_t tag,
+				     uint32_t val)
+{
+  x3f_tiff_set_long(ifd, tag, 1, &val);
+}
+
+/* Find the largest power of ten denominator that keeps the numerator
+   within range. This gives at least seven significant digits for all
+   values used in DNG files. */
+static void to_rational(double val, double max, int32_t *num, uint32_t *den)
+{
+  double d = 1000000000.0;
+
+  while (d > 1.0 && fabs(val)*d > max) d /= 10.0;
+
+  *num = (int32_t)round(val*d);
+  *den = (uint32_t)d;
+}
+
+/* extern */ void x3f_tiff_set_rational(x3f_tiff_ifd_t *ifd, uint16_t tag,
+					uint32_t count, const double *val)
+{
+  x3f_tiff_entry_t *e = get_entry(ifd, tag);
+  uint32_t *data;
+  int i;
+
+  e->type = TIFF_RATIONAL;
+  e->count = count;
+  e->data = data = malloc(entry_data_size(e));
+
+  for (i=0; i<count; i++) {
+    int32_t num;
+
+    /* Negative values cannot be represented, clip to zero */
+    to_rational(val[i] > 0.0 ? val[i] : 0.0, INT32_MAX, &num, &data[2*i+1]);
+    data[2*i] = num;
+  }
+}
+
+/* extern */ void x3f_tiff_set_srational(x3f_tiff_ifd_t *ifd, uint16_t tag,
+					 uint32_t count, const double *val)
+{
+  x3f_tiff_entry_t *e = get_entry(ifd, tag);
+  uint32_t *data;
+  int i;
+
+  e->type = TIFF_SRATIONAL;
+  e->count = count;
+  e->data = data = malloc(entry_data_size(e));
+
+  for (i=0; i<count; i++) {
+    int32_t num;
+
+    to_rational(val[i], INT32_MAX, &num, &data[2*i+1]);
+    data[2*i] = (uint32_t)num;
+  }
+}
+
+/* extern */ void x3f_tiff_set_undefined(x3f_tiff_ifd_t *ifd, uint16_t tag,
+					 uint32_t count, const void *val)
+{
+  set_entry(ifd, tag, TIFF_UNDEFINED, count, val);
+}
+
+/* extern */ uint32_t x3f_tiff_ifd_size(x3f_tiff_ifd_t *ifd)
+{
+  uint32_t size = 2 + ENTRY_SIZE*ifd->num + 4;
+  int i;
+
+  for (i=0; i<ifd->num; i++) {
+    uint32_t s = entry_data_size(&ifd->entry[i]);
+
+    if (s > 4) size += (s + 1) & ~1;
+  }
+
+  return size;
+}
+
+/* Routines for writing in the selected byte order */
+
+static void put_16(uint8_t *p, uint16_t val, int big_endian)
+{
+  if (big_endian) {
+    p[0] = val >> 8;
+    p[1] = val >> 0;
+  } else {
+    p[0] = val >> 0;
+    p[1] = val >> 8;
+  }
+}
+
+static void put_32(uint8_t *p, uint32_t val, int big_endian)
+{
+  if (big_endian) {
+    p[0] = val >> 24;
+    p[1] = val >> 16;
+    p[2] = val >> 8;
+    p[3] = val >> 0;
+  } else {
+    p[0] = val >> 0;
+    p[1] = val >> 8;
+    p[2] = val >> 16;
+    p[3] = val >> 24;
+  }
+}
+
+static void put_values(uint8_t *p, x3f_tiff_entry_t *e, int big_endian)
+{
+  int i;
+
+  switch (type_size(e->type)) {
+  case 1:
+    memcpy(p, e->data, e->count);
+    break;
+  case 2:
+    for (i=0; i<e->count; i++)
+      put_16(p + 2*i, ((uint16_t *)e->data)[i], big_endian);
+    break;
+  case 4:
+    for (i=0; i<e->count; i++)
+      put_32(p + 4*i, ((uint32_t *)e->data)[i], big_endian);
+    break;
+  case 8:
+    /* (S)RATIONAL is two 32-bit values */
+    for (i=0; i<2*e->count; i++)
+      put_32(p + 4*i, ((uint32_t *)e->data)[i], big_endian);
+    break;
+  }
+}
+
+/* extern */ void x3f_tiff_ifd_write(x3f_tiff_ifd_t *ifd, uint8_t *buf,
+				     uint32_t offset, uint32_t next_ifd,
+				     int big_endian)
+{
+  uint8_t *p = buf;
+  uint32_t ext = 2 + ENTRY_SIZE*ifd->num + 4; /* Out-of-line values */
+  int i;
+
+  memset(buf, 0, x3f_tiff_ifd_size(ifd));
+
+  put_16(p, ifd->num, big_endian);
+  p += 2;
+
+  for (i=0; i<ifd->num; i++, p += ENTRY_SIZE) {
+    x3f_tiff_entry_t *e = &ifd->entry[i];
+    uint32_t s = entry_data_size(e);
+
+    put_16(p + 0, e->tag, big_endian);
+    put_16(p + 2, e->type, big_endian);
+    put_32(p + 4, e->count, big_endian);
+
+    if (s <= 4)
+      put_values(p + 8, e, big_endian);
+    else {
+      put_32(p + 8, offset + ext, big_endian);
+      put_values(buf + ext, e, big_endian);
+      ext += (s + 1) & ~1;
+    }
+  }
+
+  put_32(p, next_ifd, big_endian);
+}
+
+/* extern */ void x3f_tiff_header_write(uint8_t *buf, uint16_t magic,
+					uint32_t first_ifd, int big_endian)
+{
+  buf[0] = buf[1] = big_endian ? 'M' : 'I';
+  put_16(buf + 2, magic, big_endian);
+  put_32(buf + 4, first_ifd, big_endian);
+}
+
+/* extern */ int x3f_tiff_host_is_big_endian(void)
+{
+  const uint16_t one = 1;
+
+  return *(const uint8_t *)&one == 0;
+}
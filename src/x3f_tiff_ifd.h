@@ -0,0 +1,79 @@
+/* X3F_TIFF_IFD.H
+ *
+ * Library for building TIFF image file directories in memory.
+ *
+ * The IFDs are laid out completely before anything is written, which
+ * makes it possible to emit a TIFF or DNG file strictly front to
+ * back, e.g. to a pipe or a socket.
+ *
+ * Copyright 2016 - Roland and Erik Karlsson
+ * BSD-style - see doc/copyright.txt
+ *
+ */
+
+#ifndef X3F_TIFF_IFD_H
+#define X3F_TIFF_IFD_H
+
+#include <inttypes.h>
+#include <tiff.h>
+
+#define X3F_TIFF_HEADER_SIZE 8
+#define X3F_TIFF_MAX_ENTRIES 48
+
+typedef struct {
+  uint16_t tag;
+  uint16_t type;		/* TIFF_SHORT, TIFF_LONG, ... */
+  uint32_t count;
+  void *data;			/* count values in native endian */
+} x3f_tiff_entry_t;
+
+typedef struct {
+  int num;			/* Kept sorted on tag */
+  x3f_tiff_entry_t entry[X3F_TIFF_MAX_ENTRIES];
+} x3f_tiff_ifd_t;
+
+extern void x3f_tiff_ifd_init(x3f_tiff_ifd_t *ifd);
+extern void x3f_tiff_ifd_cleanup(x3f_tiff_ifd_t *ifd);
+
+/* Setting a tag that is already set replaces the old value. The size
+   of the IFD only depends on tags, types and counts, so offsets can
+   be patched in with the same count after the layout is computed. */
+extern void x3f_tiff_set_byte(x3f_tiff_ifd_t *ifd, uint16_t tag,
+			      uint32_t count, const uint8_t *val);
+extern void x3f_tiff_set_ascii(x3f_tiff_ifd_t *ifd, uint16_t tag,
+			       const char *val);
+extern void x3f_tiff_set_short(x3f_tiff_ifd_t *ifd, uint16_t tag,
+			       uint32_t count, const uint16_t *val);
+extern void x3f_tiff_set_long(x3f_tiff_ifd_t *ifd, uint16_t tag,
+			      uint32_t count, const uint32_t *val);
+extern void x3f_tiff_set_rational(x3f_tiff_ifd_t *ifd, uint16_t tag,
+				  uint32_t count, const double *val);
+extern void x3f_tiff_set_srational(x3f_tiff_ifd_t *ifd, uint16_t tag,
+				   uint32_t count, const double *val);
+extern void x3f_tiff_set_undefined(x3f_tiff_ifd_t *ifd, uint16_t tag,
+				   uint32_t count, const void *val);
+
+/* Convenience for the very common single SHORT/LONG valued tags */
+extern void x3f_tiff_set_short1(x3f_tiff_ifd_t *ifd, uint16_t tag,
+				uint16_t val);
+extern void x3f_tiff_set_long1(x3f_tiff_ifd_t *ifd, uint16_t tag,
+			       uint32_t val);
+
+/* Size in bytes of the IFD including all out-of-line values. Always
+   even, so the next object is word aligned. */
+extern uint32_t x3f_tiff_ifd_size(x3f_tiff_ifd_t *ifd);
+
+/* Serialize the IFD into buf, which must hold x3f_tiff_ifd_size()
+   bytes. offset is the position of buf relative to the start of the
+   TIFF stream, next_ifd is the offset of the following IFD or 0. */
+extern void x3f_tiff_ifd_write(x3f_tiff_ifd_t *ifd, uint8_t *buf,
+			       uint32_t offset, uint32_t next_ifd,
+			       int big_endian);
+
+/* Write the 8 byte TIFF header. magic is 42 for ordinary TIFF files. */
+extern void x3f_tiff_header_write(uint8_t *buf, uint16_t magic,
+				  uint32_t first_ifd, int big_endian);
+
+extern int x3f_tiff_host_is_big_endian(void);
+
+#endif	/* X3F_TIFF_IFD_H */